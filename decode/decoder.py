@@ -49,6 +49,18 @@ lastSignalTime = 0
 packet = []
 listeners = []
 
+# signal_process -d interleaves pulses from several receivers, tagged with a
+# stream id. Each stream gets its own decoding state.
+streams = {}
+currentStream = None
+
+# Sensors send each packet several times in a row. Only the first copy of a burst is
+# published, as signal_process does on its bus (see signal/dedup.h). Times are the
+# pulse times, in usecs - they're per stream, and go backwards when the timebase resets.
+DEDUP_GAP = 200000
+DEDUP_MAX_AGE = 2000000
+recentPackets = {}  # (stream, id, raw) -> (first seen, last seen)
+
 class BitException(Exception):
     def __init__(self):
         pass
@@ -66,6 +78,19 @@ def reset():
     packet = []
     state = "pending signal"
 
+def selectStream(streamId):
+    global state
+    global lastSignalTime
+    global packet
+    global currentStream
+    
+    if streamId == currentStream:
+        return
+    if currentStream is not None:
+        streams[currentStream] = (state, lastSignalTime, packet)
+    state, lastSignalTime, packet = streams.get(streamId, ("pending signal", 0, []))
+    currentStream = streamId
+
 def emitBit(deltaTime):
     global packet
     
@@ -131,6 +156,19 @@ def acceptSignal(startTime, length):
         logger.error("Invalid distance {} between packets".format(deltaTime))
         reset()
             
+def isRepeat(key, now):
+    ''' Whether this packet is a copy of one just published. Forgets finished bursts as it goes '''
+    global recentPackets
+    
+    seen = recentPackets.get(key)
+    if seen is not None and 0 <= now - seen[1] <= DEDUP_GAP and now - seen[0] <= DEDUP_MAX_AGE:
+        recentPackets[key] = (seen[0], now)
+        return True
+    for k in [k for k, v in recentPackets.items() if k[0] == key[0] and not 0 <= now - v[1] <= DEDUP_GAP]:
+        del recentPackets[k]
+    recentPackets[key] = (now, now)
+    return False
+
 def registerListener(callback):
     global listeners
     
@@ -178,7 +216,12 @@ def processPacket():
         
 #    triggered = (open1 == 1)
     
+    if isRepeat((currentStream, id, str(raw)), lastSignalTime):
+        return
+    
     msg["id"] = id
+    if currentStream is not None:
+        msg["stream"] = currentStream
 #    msg["triggered"] = triggered
     msg["ts"] = time.time()
     msg["raw"] = raw
@@ -319,6 +362,8 @@ def realMain():
             for line in iter(sys.stdin.readline, ''):
                 signal = json.loads(line)
                 #print(signal)
+                if len(signal) > 2:
+                    selectStream(signal[2])
                 acceptSignal(signal[0], signal[1])
         except KeyboardInterrupt:
             break
@@ -0,0 +1,158 @@
+#
+# The signal_process detector, in-process. Wraps signal/libdetector.so
+#
+
+import ctypes
+import os
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+''' Runs raw rtl_sdr samples (interleaved unsigned 8 bit I/Q) through the same detector
+as signal_process, without the subprocess or the text in between.
+
+Samples can be bytes, bytearray, memoryview, mmap, or a numpy uint8/int8 array. They're
+read where they are - nothing is copied unless a numpy array isn't contiguous, or
+(without numpy) a read-only buffer isn't a whole bytes object. The GIL is released while the detector runs, so sessions
+on different threads run in parallel:
+
+    with concurrent.futures.ThreadPoolExecutor() as pool:
+        results = pool.map(lambda f: detect(numpy.fromfile(f, numpy.uint8)), captures)
+
+Pulses come back as a numpy structured array with fields startTime (usecs, on the
+detector's timebase - the same numbers signal_process prints), endSample (the last
+sample in the pulse, counting from the first one fed), duration (usecs) and snr (dB
+above the rest of the spectrum). Without numpy, they're a list of (startTime,
+endSample, duration, snr) tuples.
+
+The detector's timebase resets after five seconds without a signal, like signal_process,
+but the five seconds are counted in samples rather than on the wall clock, so the same
+capture always gives the same startTimes however fast it's fed. endSample never resets.
+
+Looks for libdetector.so in $LIBDETECTOR, then next to signal_process. '''
+
+class DetectorPulse(ctypes.Structure):
+    _fields_ = [("startTime", ctypes.c_uint64),
+                ("endSample", ctypes.c_uint64),
+                ("duration", ctypes.c_uint32),
+                ("snr", ctypes.c_float)]
+
+if numpy is not None:
+    PULSE_DTYPE = numpy.dtype([("startTime", "<u8"), ("endSample", "<u8"),
+                               ("duration", "<u4"), ("snr", "<f4")])
+
+DEFAULT_RATE = 1000000
+DEFAULT_STRIDE = 16
+
+_lib = None
+
+def libraryPath():
+    return os.environ.get("LIBDETECTOR",
+               os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "signal", "libdetector.so"))
+
+def _loadLibrary():
+    global _lib
+    if _lib is not None:
+        return _lib
+    # NB - CDLL, not PyDLL. ctypes lets go of the GIL for the length of every call.
+    lib = ctypes.CDLL(libraryPath())
+    lib.detectorSessionCreate.restype = ctypes.c_void_p
+    lib.detectorSessionCreate.argtypes = [ctypes.c_int, ctypes.c_int]
+    lib.detectorSessionDestroy.restype = None
+    lib.detectorSessionDestroy.argtypes = [ctypes.c_void_p]
+    lib.detectorSessionFeed.restype = ctypes.c_long
+    lib.detectorSessionFeed.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    lib.detectorSessionSkip.restype = None
+    lib.detectorSessionSkip.argtypes = [ctypes.c_void_p, ctypes.c_ulonglong]
+    lib.detectorSessionTake.restype = ctypes.c_long
+    lib.detectorSessionTake.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_long]
+    _lib = lib
+    return lib
+
+def _samplePointer(samples):
+    ''' Returns (pointer, length, keepalive). pointer is something ctypes will take as
+    a void *; keepalive has to outlive the call. '''
+    if numpy is not None and isinstance(samples, numpy.ndarray):
+        if samples.dtype not in (numpy.uint8, numpy.int8):
+            raise TypeError("samples must be 8 bit, not {}".format(samples.dtype))
+        samples = numpy.ascontiguousarray(samples)     # no copy if it already is
+        return samples.ctypes.data, samples.nbytes, samples
+    if isinstance(samples, bytes):
+        return samples, len(samples), samples            # ctypes passes bytes in place
+    view = memoryview(samples)
+    if not view.contiguous:
+        raise TypeError("samples must be contiguous")
+    if view.readonly:
+        if numpy is not None:
+            array = numpy.frombuffer(view, numpy.uint8)
+            return array.ctypes.data, array.nbytes, array
+        if isinstance(view.obj, bytes) and view.nbytes == len(view.obj):
+            return view.obj, view.nbytes, view.obj
+        data = view.tobytes()   # ctypes has no way at a read-only buffer's address
+        return data, len(data), data
+    buf = (ctypes.c_char * view.nbytes).from_buffer(view)
+    return ctypes.addressof(buf), view.nbytes, (buf, view)
+
+class Detector:
+    ''' One stream of samples. Keeps its state between calls to feed, so a capture can
+    be fed in pieces. '''
+
+    def __init__(self, rate=DEFAULT_RATE, stride=DEFAULT_STRIDE):
+        self._lib = _loadLibrary()
+        self._session = self._lib.detectorSessionCreate(rate, stride)
+        if not self._session:
+            raise RuntimeError("Cannot create detector, rate {}, stride {}".format(rate, stride))
+        self.rate = rate
+        self.stride = stride
+
+    def close(self):
+        if getattr(self, "_session", None):
+            self._lib.detectorSessionDestroy(self._session)
+            self._session = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def feed(self, samples):
+        ''' Returns the pulses that ended in these samples '''
+        pointer, length, keepalive = _samplePointer(samples)
+        nPulses = self._lib.detectorSessionFeed(self._session, pointer, length)
+        del keepalive
+        return self._take(nPulses)
+
+    def skip(self, nSamples):
+        ''' nSamples are missing from the input '''
+        self._lib.detectorSessionSkip(self._session, nSamples)
+
+    def _take(self, nPulses):
+        if numpy is not None:
+            pulses = numpy.empty(nPulses, dtype=PULSE_DTYPE)
+            if nPulses:
+                self._lib.detectorSessionTake(self._session, pulses.ctypes.data, nPulses)
+            return pulses
+        pulses = (DetectorPulse * nPulses)()
+        if nPulses:
+            self._lib.detectorSessionTake(self._session, ctypes.addressof(pulses), nPulses)
+        return [(p.startTime, p.endSample, p.duration, p.snr) for p in pulses]
+
+def detect(samples, rate=DEFAULT_RATE, stride=DEFAULT_STRIDE):
+    ''' All the pulses in a capture '''
+    with Detector(rate, stride) as detector:
+        return detector.feed(samples)
+
+def detectFile(filename, rate=DEFAULT_RATE, stride=DEFAULT_STRIDE):
+    ''' All the pulses in a capture file. The file is mapped, not read. '''
+    import mmap
+    with open(filename, "rb") as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            return detect(b"", rate, stride)
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY) as samples:
+            return detect(samples, rate, stride)
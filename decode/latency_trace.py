@@ -0,0 +1,53 @@
+#
+# Reads latency trace files written by signal_process -t
+#
+
+import struct
+import sys
+
+''' The trace file is a 16 byte header followed by one 24 byte record per emitted
+event. All values are little endian. Latencies are from the arrival of the last
+sample that contributed to the event to the event being written out. Events are
+pulses, and (when the packet decoder is running) packets - a packet's latency runs
+from its last pulse to the decoder handing it on. '''
+
+TRACE_MAGIC = 0x544c5357
+HEADER = struct.Struct("<IHHII")    # magic, version, record size, sample rate, reserved
+RECORD = struct.Struct("<QIIII")    # emit nsec, latency nsec, start time, duration, event
+
+EVENT_NAMES = {1: "pulse", 2: "packet"}
+
+def readTrace(filename):
+    ''' Returns (sampleRate, list of (emitNsec, latencyNsec, startTime, duration, event)) '''
+    with open(filename, "rb") as f:
+        magic, version, recordSize, sampleRate, _ = HEADER.unpack(f.read(HEADER.size))
+        if magic != TRACE_MAGIC or recordSize != RECORD.size:
+            raise ValueError("{} is not a latency trace".format(filename))
+        data = f.read()
+    count = len(data) // RECORD.size
+    return sampleRate, [RECORD.unpack_from(data, i*RECORD.size) for i in range(count)]
+
+def percentile(sortedValues, percent):
+    if not sortedValues:
+        return 0
+    index = min(len(sortedValues) - 1, (len(sortedValues)*percent + 99)//100 - 1)
+    return sortedValues[max(index, 0)]
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write("Usage: {} traceFile\n".format(sys.argv[0]))
+        sys.exit(2)
+
+    sampleRate, records = readTrace(sys.argv[1])
+    print("sample rate {}, {} events".format(sampleRate, len(records)))
+    for event in sorted(set(r[4] for r in records)):
+        latencies = sorted(r[1]/1000.0 for r in records if r[4] == event)
+        print("{}: {} events, p50 {:.1f} usec, p99 {:.1f} usec, max {:.1f} usec".format(
+              EVENT_NAMES.get(event, event), len(latencies),
+              percentile(latencies, 50), percentile(latencies, 99), latencies[-1]))
+    if "-v" in sys.argv:
+        for (emitNsec, latencyNsec, startTime, duration, event) in records:
+            print("{} [{}, {}] {:.1f} usec".format(EVENT_NAMES.get(event, event), startTime, duration, latencyNsec/1000.0))
+
+if __name__ == '__main__':
+    main()
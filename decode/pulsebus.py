@@ -0,0 +1,216 @@
+#
+# Reads the shared memory pulse bus written by signal_process -b
+#
+
+import argparse
+import ctypes
+import json
+import mmap
+import os
+import platform
+import struct
+import sys
+import time
+
+import detector
+
+''' The bus is a ring of fixed size records in /dev/shm/<name>, with one writer
+(signal_process) and any number of readers, who never hold the writer up. See
+signal/pulsebus.h for the layout. Each slot has a sequence number that's odd while
+the writer is in the middle of it; a reader copies the record, then checks the
+sequence number again to make sure it wasn't overwritten in the meantime. A reader
+that falls more than a ring behind is told how many records it missed, and carries
+on from half a ring behind the writer.
+
+That only works if the loads happen in order, and Python can't promise that. So the
+reading is done by libdetector.so (see detector.py for where it's looked for), which
+does it with acquire loads. Without it we fall back to reading the bus from Python,
+which is only safe on x86 - it doesn't reorder loads. '''
+
+BUS_MAGIC = 0x53554257
+BUS_VERSION = 3
+
+HEADER = struct.Struct("<IHHIIQ40x")    # magic, version, slot size, slots, producer pid, write seq
+SLOT = struct.Struct("<Q40s")           # seq, record
+RECORD = struct.Struct("<HHIQIIQf4x")   # type, stream, duration, start time, sensor id, repeats, bits, snr
+SEQ = struct.Struct("<Q")
+
+BUS_PULSE = 1
+BUS_PACKET = 2     # first copy of a packet
+BUS_BURST = 3      # the copies of a packet, once the sensor's gone quiet
+
+PACKET_BITS = 59
+SENSOR_ID_START = 12
+
+WRITE_SEQ_OFFSET = 16
+
+X86 = ("x86_64", "amd64", "i386", "i486", "i586", "i686", "x86")
+
+class BusError(Exception):
+    pass
+
+_lib = None
+
+def _loadLibrary():
+    ''' libdetector.so with the bus reader calls set up, or None if there isn't one '''
+    global _lib
+    if _lib is None:
+        try:
+            lib = ctypes.CDLL(detector.libraryPath())
+        except OSError:
+            return None
+        lib.detectorBusAttach.restype = ctypes.c_void_p
+        lib.detectorBusAttach.argtypes = [ctypes.c_char_p]
+        lib.detectorBusDetach.restype = None
+        lib.detectorBusDetach.argtypes = [ctypes.c_void_p]
+        lib.detectorBusRead.restype = ctypes.c_int
+        lib.detectorBusRead.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        _lib = lib
+    return _lib
+
+def BusReader(name):
+    ''' Attaches to the named bus, through libdetector.so if we can '''
+    lib = _loadLibrary()
+    if lib is not None:
+        return LibraryBusReader(lib, name)
+    if platform.machine().lower() not in X86:
+        raise BusError("Reading the bus on {} needs libdetector.so".format(platform.machine()))
+    return PythonBusReader(name)
+
+class BusReaderBase:
+    def __init__(self, name):
+        self.name = name.lstrip("/")
+        self.path = os.path.join("/dev/shm", self.name)
+
+    def stale(self):
+        ''' True if the producer has gone away, or started a new bus under our name '''
+        try:
+            return os.stat(self.path).st_ino != self.inode
+        except FileNotFoundError:
+            return True
+
+    def read(self):
+        ''' Returns (record, lost). record is a RECORD tuple, or None if there's nothing
+        new. lost is the number of records we were lapped by. '''
+        raise NotImplementedError
+
+    def records(self, pollInterval=0.01):
+        ''' Yields (record, lost) forever, sleeping when there's nothing to read '''
+        while True:
+            record, lost = self.read()
+            if record is None and lost == 0:
+                time.sleep(pollInterval)
+                continue
+            yield record, lost
+
+class LibraryBusReader(BusReaderBase):
+    def __init__(self, lib, name):
+        BusReaderBase.__init__(self, name)
+        self.lib = lib
+        self.inode = os.stat(self.path).st_ino
+        self.reader = lib.detectorBusAttach(self.name.encode())
+        if not self.reader:
+            raise BusError("{} is not a pulse bus, or is not ready".format(self.path))
+        self.record = ctypes.create_string_buffer(RECORD.size)
+        self.lost = ctypes.c_uint64()
+
+    def close(self):
+        if self.reader:
+            self.lib.detectorBusDetach(self.reader)
+            self.reader = None
+
+    def read(self):
+        if not self.lib.detectorBusRead(self.reader, self.record, ctypes.byref(self.lost)):
+            return None, self.lost.value
+        return RECORD.unpack(self.record.raw), self.lost.value
+
+class PythonBusReader(BusReaderBase):
+    ''' x86 only '''
+    def __init__(self, name):
+        BusReaderBase.__init__(self, name)
+        with open(self.path, "rb") as f:
+            self.inode = os.fstat(f.fileno()).st_ino
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, slotSize, self.nSlots, self.producerPid, writeSeq = HEADER.unpack_from(self.map, 0)
+        if magic != BUS_MAGIC or version != BUS_VERSION or slotSize != SLOT.size:
+            self.map.close()
+            raise BusError("{} is not a pulse bus, or is not ready".format(self.path))
+        self.nextSeq = writeSeq + 1
+
+    def close(self):
+        self.map.close()
+
+    def read(self):
+        lost = 0
+        while True:
+            seq = self.nextSeq
+            offset = HEADER.size + (seq & (self.nSlots - 1))*SLOT.size
+            before, data = SLOT.unpack_from(self.map, offset)
+            if before < 2*seq:
+                return None, lost
+            if before == 2*seq:
+                after, = SEQ.unpack_from(self.map, offset)
+                if after == before:
+                    self.nextSeq += 1
+                    return RECORD.unpack(data), lost
+            # lapped
+            writeSeq, = SEQ.unpack_from(self.map, WRITE_SEQ_OFFSET)
+            resume = max(writeSeq - self.nSlots//2 + 1, seq + 1)
+            lost += resume - seq
+            self.nextSeq = resume
+
+def packetToMsg(record):
+    ''' Same as decoder.py publishes '''
+    _, stream, _, _, sensorId, repeats, bits, snr = record
+    packet = [(bits >> (PACKET_BITS - 1 - i)) & 1 for i in range(PACKET_BITS)]
+    raw = [packet[4*i : 4*(i+1)] for i in range(9, PACKET_BITS//4)]
+    return {"id": "{:06x}".format(sensorId), "stream": stream, "ts": time.time(),
+            "raw": raw, "repeats": repeats, "snr": round(snr, 1)}
+
+def main():
+    parser = argparse.ArgumentParser(description="Print what signal_process publishes on its pulse bus")
+    parser.add_argument("bus", help="bus name, as given to signal_process -b")
+    parser.add_argument("-p", "--pulses", action="store_true",
+                        help="print pulses, as [start, duration, stream], the way decoder.py reads them")
+    parser.add_argument("-k", "--packets", action="store_true",
+                        help="print packets as json, the way decoder.py writes them - one per burst of repeats")
+    parser.add_argument("-B", "--bursts", action="store_true",
+                        help="also print the end of each burst of repeats, as a packet with \"burst\": true. "
+                             "It's the same event again, so don't feed these to sensor.py")
+    args = parser.parse_args()
+    if not args.pulses and not args.packets:
+        args.pulses = args.packets = True
+
+    reader = None
+    while True:
+        if reader is None:
+            try:
+                reader = BusReader(args.bus)
+            except (OSError, BusError):
+                time.sleep(1)
+                continue
+        record, lost = reader.read()
+        if lost:
+            sys.stderr.write("Lapped, lost {} records\n".format(lost))
+        if record is None:
+            if reader.stale():
+                reader.close()
+                reader = None
+            else:
+                time.sleep(0.01)
+            continue
+        if record[0] == BUS_PULSE and args.pulses:
+            print("[{}, {}, {}]".format(record[3], record[2], record[1]))
+        elif record[0] == BUS_PACKET and args.packets:
+            print(json.dumps(packetToMsg(record)))
+        elif record[0] == BUS_BURST and args.bursts:
+            msg = packetToMsg(record)
+            msg["burst"] = True
+            print(json.dumps(msg))
+        sys.stdout.flush()
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
@@ -284,6 +284,8 @@ def readSensorEvents(eventstream_identifier):
         for line in iter(f.readline, ''):
             #print(line)
             event = json.loads(line)
+            if event.get("burst"):
+                continue    # pulsebus.py -B - the end of a burst we've already had
             handleEvent(event)
     except Exception as e:
         traceback.print_exc()
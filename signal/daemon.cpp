@@ -0,0 +1,558 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "detector.h"
+#include "daemon.h"
+#include "packet.h"
+#include "dedup.h"
+#include "pulsebus.h"
+#include "rtltcp.h"
+
+#ifndef MIN
+#define MIN(a,b) (a<b?a:b)
+#endif
+
+/* One thread (the caller's) does all the reading. It reads each input straight into
+   that stream's ring buffer, and wakes the stream's worker. Workers feed whatever is
+   in their streams' rings to the detectors.
+
+   If a worker can't keep up, its stream's ring fills and the reader stops polling
+   that input until the worker makes room - the pressure goes back upstream, same as
+   it would with a pipe, without holding up the other streams.
+
+   rtl_tcp inputs are the exception. Reconnecting blocks, for as long as the server's
+   away, so each has a thread of its own to do its reading (and reconnecting) with
+   rtltcp.cpp, straight into the ring. It waits on its own eventfd when the ring's full. */
+
+#define STREAM_RING_SIZE  (1 << 20)     // bytes, must be a power of two. ~half a second at 1MS/s
+#define DRAIN_BLOCK       (1 << 16)     // bytes fed to the detector before giving back ring space
+#define MAX_EPOLL_EVENTS  32
+#define RTL_HEADER_SIZE   12            // "RTL0", tuner type, gain count
+
+typedef enum {
+    STREAM_FILE,        // can't be polled. Always readable
+    STREAM_FIFO,
+    STREAM_SOCKET,
+    STREAM_RTLTCP       // read on its own thread, not polled
+} eStreamType;
+
+struct Worker;
+
+typedef struct {
+    int id;
+    const char *name;
+    eStreamType type;
+    int fd;
+    Detector *detector;
+    PacketDecoder *packetDecoder;   // only if there's a bus
+    DedupTable *dedupTable;         // ditto
+    struct Worker *worker;
+
+    // Only the reader moves head, only the worker moves tail. Both only increase.
+    unsigned char *ring;
+    size_t head;
+    size_t tail;
+    bool eof;           // everything the input will ever give us is in the ring
+    bool paused;        // ring was full, reader isn't polling
+    int spaceFd;        // the worker pokes this when paused and it's made room
+
+    // rtl_tcp only. Samples lost to a reconnect, which the worker skips when it gets
+    // to skipPos in the ring. Only one at a time.
+    RtlTcpClient *rtlClient;
+    pthread_t rtlThread;
+    bool skipPending;
+    size_t skipPos;
+    unsigned long long skipSamples;
+
+    // worker only
+    bool checkHeader;
+    unsigned long long bytesFed;        // bytes - a drain can end halfway through a sample
+} Stream;
+
+typedef struct Worker {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;       // there may be new data
+    bool quit;
+    Stream **streams;
+    int nStreams;
+} Worker;
+
+static int spaceEventFd = -1;   // workers poke this when a paused stream has room again
+static PulseBus *pulseBus = NULL;
+static pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;    // the bus has one producer at a time
+
+
+static void emitStreamPulse(void *context, unsigned long startTime, unsigned long duration, unsigned long long lastSample,
+                            float snr)
+{
+    Stream *stream = (Stream *)context;
+
+    flockfile(stdout);
+    fprintf(stdout, "[%lu, %lu, %d]\n", startTime, duration, stream->id);
+    fflush(stdout);
+    funlockfile(stdout);
+    if (pulseBus) {
+        pthread_mutex_lock(&busLock);
+        busPublishPulse(pulseBus, stream->id, startTime, duration, snr);
+        pthread_mutex_unlock(&busLock);
+        // the decoder and dedup table belong to the stream, so only its worker gets here
+        packetDecoderAccept(stream->packetDecoder, startTime, duration, lastSample, snr);
+    }
+}
+
+static void emitStreamPacket(void *context, const Packet *packet)
+{
+    Stream *stream = (Stream *)context;
+
+    dedupAdd(stream->dedupTable, packet);
+}
+
+static void emitStreamBurst(void *context, const Packet *packet, unsigned int repeats, bool burstEnd)
+{
+    Stream *stream = (Stream *)context;
+
+    pthread_mutex_lock(&busLock);
+    if (burstEnd) {
+        busPublishBurst(pulseBus, stream->id, packet->startTime, packet->endTime - packet->startTime,
+                        packet->sensorId, repeats, packet->bits, packet->snr);
+    } else {
+        busPublishPacket(pulseBus, stream->id, packet->startTime, packet->endTime - packet->startTime,
+                         packet->sensorId, repeats, packet->bits, packet->snr);
+    }
+    pthread_mutex_unlock(&busLock);
+}
+
+static void wakeWorker(Worker *worker, bool quit)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->pending = true;
+    worker->quit |= quit;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+
+// - Worker side.
+
+static void streamDrain(Stream *stream)
+{
+    size_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+    size_t tail = stream->tail;
+
+    if (stream->checkHeader) {
+        // rtl_tcp sends a dongle header before the samples.
+        if (head - tail < RTL_HEADER_SIZE && !__atomic_load_n(&stream->eof, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        if (head - tail >= RTL_HEADER_SIZE && memcmp(stream->ring, "RTL0", 4) == 0) {
+            tail += RTL_HEADER_SIZE;
+        }
+        stream->checkHeader = false;
+    }
+
+    for (;;) {
+        // a reconnect gap goes between the samples either side of it
+        bool skip = __atomic_load_n(&stream->skipPending, __ATOMIC_ACQUIRE);
+        if (skip && tail == stream->skipPos) {
+            detectorSkip(stream->detector, stream->skipSamples);
+            stream->bytesFed += stream->skipSamples*2;
+            __atomic_store_n(&stream->skipPending, false, __ATOMIC_RELEASE);
+            skip = false;
+        }
+        if (tail == head) {
+            break;
+        }
+        size_t end = (skip && stream->skipPos - tail < head - tail) ? stream->skipPos : head;
+        size_t offset = tail & (STREAM_RING_SIZE - 1);
+        size_t n = MIN(end - tail, MIN((size_t)DRAIN_BLOCK, STREAM_RING_SIZE - offset));
+        detectorFeed(stream->detector, stream->ring + offset, (int)n);
+        stream->bytesFed += n;
+        if (stream->dedupTable) {
+            dedupExpire(stream->dedupTable, stream->bytesFed/2);
+        }
+        tail += n;
+        __atomic_store_n(&stream->tail, tail, __ATOMIC_SEQ_CST);
+    }
+
+    // Pairs with the reader setting paused, then checking tail. One of us sees the other.
+    if (__atomic_load_n(&stream->paused, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(stream->spaceFd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "Cannot wake reader, %s\n", strerror(errno));
+        }
+    }
+}
+
+static void *workerMain(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    bool quit = false;
+
+    while (!quit) {
+        pthread_mutex_lock(&worker->lock);
+        while (!worker->pending && !worker->quit) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        worker->pending = false;
+        quit = worker->quit;
+        pthread_mutex_unlock(&worker->lock);
+
+        // NB - on quit, go round once more. Anything read before quit was set is drained.
+        for (int i=0; i<worker->nStreams; i++) {
+            streamDrain(worker->streams[i]);
+        }
+    }
+    return NULL;
+}
+
+
+// - Reader side.
+
+static int openUnixSocket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool streamOpen(Stream *stream, const RtlTcpSettings *rtlSettings)
+{
+    struct stat st;
+
+    stream->spaceFd = spaceEventFd;
+    if (strncmp(stream->name, "tcp:", 4) == 0) {
+        stream->type = STREAM_RTLTCP;
+        stream->fd = -1;
+        // NB - blocking. The thread has nothing else to do while it waits.
+        if ((stream->spaceFd = eventfd(0, 0)) < 0) {
+            fprintf(stderr, "Cannot open %s, %s\n", stream->name, strerror(errno));
+            return false;
+        }
+        // rtlTcpCreate has its own complaints
+        return (stream->rtlClient = rtlTcpCreate(stream->name + 4, rtlSettings)) != NULL;
+    } else if (strncmp(stream->name, "unix:", 5) == 0) {
+        stream->type = STREAM_SOCKET;
+        stream->fd = openUnixSocket(stream->name + 5);
+        stream->checkHeader = true;
+    } else {
+        // NB - non-blocking, or we'd wait here for a FIFO's writer to show up
+        stream->fd = open(stream->name, O_RDONLY | O_NONBLOCK);
+        if (stream->fd >= 0 && fstat(stream->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            stream->type = STREAM_FILE;
+            fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) & ~O_NONBLOCK);
+        } else {
+            stream->type = STREAM_FIFO;
+        }
+    }
+    if (stream->fd < 0) {
+        fprintf(stderr, "Cannot open %s, %s\n", stream->name, strerror(errno));
+        return false;
+    }
+    if (stream->type == STREAM_SOCKET) {
+        fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) | O_NONBLOCK);
+    }
+    return true;
+}
+
+// Whether the reader gets the stream's fd from epoll
+static bool streamPolled(Stream *stream)
+{
+    return stream->type == STREAM_FIFO || stream->type == STREAM_SOCKET;
+}
+
+static void streamClose(Stream *stream, int epollFd)
+{
+    if (streamPolled(stream) && !stream->paused) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, stream->fd, NULL);
+    }
+    close(stream->fd);
+    stream->fd = -1;
+    __atomic_store_n(&stream->eof, true, __ATOMIC_RELEASE);
+    wakeWorker(stream->worker, false);
+}
+
+// Take the fd out of epoll altogether while paused. Asking for no events still gets
+// EPOLLHUP, so a writer that goes away while we're full would have us spinning.
+static void streamPause(Stream *stream, int epollFd)
+{
+    __atomic_store_n(&stream->paused, true, __ATOMIC_SEQ_CST);
+    if (streamPolled(stream)) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, stream->fd, NULL);
+    }
+}
+
+static void streamResume(Stream *stream, int epollFd)
+{
+    struct epoll_event ev = {EPOLLIN, {0}};
+
+    __atomic_store_n(&stream->paused, false, __ATOMIC_SEQ_CST);
+    if (streamPolled(stream)) {
+        ev.data.ptr = stream;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, stream->fd, &ev);
+    }
+}
+
+static size_t streamSpace(Stream *stream)
+{
+    return STREAM_RING_SIZE - (stream->head - __atomic_load_n(&stream->tail, __ATOMIC_SEQ_CST));
+}
+
+// Returns false once the stream has ended
+static bool streamRead(Stream *stream, int epollFd)
+{
+    size_t space = streamSpace(stream);
+
+    if (space == 0) {
+        streamPause(stream, epollFd);
+        // the worker may have made room before it could see we paused
+        if (streamSpace(stream) > 0) {
+            streamResume(stream, epollFd);
+        }
+        return true;
+    }
+
+    size_t offset = stream->head & (STREAM_RING_SIZE - 1);
+    ssize_t nBytesRead = read(stream->fd, stream->ring + offset, MIN(space, STREAM_RING_SIZE - offset));
+    if (nBytesRead > 0) {
+        __atomic_store_n(&stream->head, stream->head + nBytesRead, __ATOMIC_RELEASE);
+        wakeWorker(stream->worker, false);
+        return true;
+    } else if (nBytesRead < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+
+    if (nBytesRead < 0) {
+        fprintf(stderr, "Error reading %s, %s\n", stream->name, strerror(errno));
+    }
+    fprintf(stderr, "End of stream %d, %s\n", stream->id, stream->name);
+    streamClose(stream, epollFd);
+    return false;
+}
+
+// An rtl_tcp stream's reader. rtlTcpRead blocks, and reconnects for as long as it takes.
+static void *rtlReaderMain(void *arg)
+{
+    Stream *stream = (Stream *)arg;
+    unsigned long long samplesLost;
+    uint64_t count;
+
+    for (;;) {
+        size_t space = streamSpace(stream);
+        if (space == 0) {
+            // Same handshake with the worker as streamRead's
+            __atomic_store_n(&stream->paused, true, __ATOMIC_SEQ_CST);
+            if (streamSpace(stream) == 0 && read(stream->spaceFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                fprintf(stderr, "Cannot wait for room in %s, %s\n", stream->name, strerror(errno));
+            }
+            __atomic_store_n(&stream->paused, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        // NB - head and space are always whole samples, so there's room for at least one
+        size_t offset = stream->head & (STREAM_RING_SIZE - 1);
+        int n = rtlTcpRead(stream->rtlClient, stream->ring + offset, (int)MIN(space, STREAM_RING_SIZE - offset),
+                           &samplesLost);
+        if (samplesLost) {
+            // The worker gets to the last one long before the next reconnect. Make sure.
+            while (__atomic_load_n(&stream->skipPending, __ATOMIC_ACQUIRE)) {
+                usleep(1000);
+            }
+            stream->skipPos = stream->head;
+            stream->skipSamples = samplesLost;
+            __atomic_store_n(&stream->skipPending, true, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&stream->head, stream->head + n, __ATOMIC_RELEASE);
+        wakeWorker(stream->worker, false);
+    }
+    return NULL;
+}
+
+
+int daemonRun(char **inputs, int nInputs, int rate, int stride, int nWorkers, PulseBus *bus,
+              const RtlTcpSettings *rtlSettings)
+{
+    Stream *streams = (Stream *)calloc(nInputs, sizeof(Stream));
+    Worker *workers = (Worker *)calloc(nWorkers, sizeof(Worker));
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int epollFd = epoll_create1(0);
+    int nOpen = 0;
+    int nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    int retVal = 0;
+
+    pulseBus = bus;
+    spaceEventFd = eventfd(0, EFD_NONBLOCK);
+    if (!streams || !workers || epollFd < 0 || spaceEventFd < 0) {
+        fprintf(stderr, "Cannot start daemon, %s\n", strerror(errno));
+        exit(-1);
+    }
+    struct epoll_event spaceEvent = {EPOLLIN, {0}};
+    spaceEvent.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, spaceEventFd, &spaceEvent);
+
+    // Streams are dealt out to workers, and stay there
+    for (int i=0; i<nWorkers; i++) {
+        Worker *worker = &workers[i];
+        worker->id = i;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->streams = (Stream **)calloc(nInputs/nWorkers + 1, sizeof(Stream *));
+    }
+
+    for (int i=0; i<nInputs; i++) {
+        Stream *stream = &streams[i];
+        stream->id = i;
+        stream->name = inputs[i];
+        stream->worker = &workers[i % nWorkers];
+        stream->worker->streams[stream->worker->nStreams++] = stream;
+        stream->ring = (unsigned char *)malloc(STREAM_RING_SIZE);
+        stream->detector = detectorCreate(rate, stride, emitStreamPulse, stream);
+        if (pulseBus) {
+            stream->packetDecoder = packetDecoderCreate(emitStreamPacket, stream);
+            stream->dedupTable = dedupCreate(rate, emitStreamBurst, stream);
+        }
+        if (!stream->ring || !stream->detector || (pulseBus && (!stream->packetDecoder || !stream->dedupTable)) ||
+            !streamOpen(stream, rtlSettings)) {
+            exit(-1);
+        }
+        if (streamPolled(stream)) {
+            struct epoll_event ev = {EPOLLIN, {0}};
+            ev.data.ptr = stream;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, stream->fd, &ev);
+        }
+        nOpen++;
+        fprintf(stderr, "Stream %d, %s, worker %d\n", i, stream->name, stream->worker->id);
+    }
+
+    for (int i=0; i<nWorkers; i++) {
+        pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+        if (nCPUs > 1) {
+            // best effort. Keep each worker's detectors in one cache.
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % nCPUs, &cpus);
+            pthread_setaffinity_np(workers[i].thread, sizeof(cpus), &cpus);
+        }
+    }
+    for (int i=0; i<nInputs; i++) {
+        if (streams[i].type == STREAM_RTLTCP &&
+            pthread_create(&streams[i].rtlThread, NULL, rtlReaderMain, &streams[i]) != 0) {
+            fprintf(stderr, "Cannot start reader for %s\n", streams[i].name);
+            exit(-1);
+        }
+    }
+
+    while (nOpen > 0) {
+        // Files never show up in epoll. If one can be read, just check the others.
+        bool fileReady = false;
+        for (int i=0; i<nInputs; i++) {
+            if (streams[i].type == STREAM_FILE && streams[i].fd >= 0 && !streams[i].paused) {
+                fileReady = true;
+            }
+        }
+
+        int nEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, fileReady ? 0 : -1);
+        if (nEvents < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll failed, %s\n", strerror(errno));
+            retVal = -1;
+            break;
+        }
+        for (int i=0; i<nEvents; i++) {
+            Stream *stream = (Stream *)events[i].data.ptr;
+            if (stream == NULL) {
+                // Somebody has room. Go see who.
+                uint64_t count;
+                if (read(spaceEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    fprintf(stderr, "Cannot read space event, %s\n", strerror(errno));
+                }
+                for (int j=0; j<nInputs; j++) {
+                    if (streams[j].type != STREAM_RTLTCP && streams[j].fd >= 0 && streams[j].paused && 
+                        streamSpace(&streams[j]) > 0) {
+                        streamResume(&streams[j], epollFd);
+                    }
+                }
+            } else if (stream->fd >= 0 && !streamRead(stream, epollFd)) {
+                nOpen--;
+            }
+        }
+        for (int i=0; i<nInputs; i++) {
+            Stream *stream = &streams[i];
+            if (stream->type == STREAM_FILE && stream->fd >= 0 && !stream->paused &&
+                !streamRead(stream, epollFd)) {
+                nOpen--;
+            }
+        }
+    }
+
+    for (int i=0; i<nWorkers; i++) {
+        wakeWorker(&workers[i], true);
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        pthread_cond_destroy(&workers[i].cond);
+        free(workers[i].streams);
+    }
+    for (int i=0; i<nInputs; i++) {
+        if (streams[i].fd >= 0) {
+            close(streams[i].fd);
+        }
+        if (streams[i].type == STREAM_RTLTCP) {
+            // NB - unreachable, since rtl_tcp streams never end
+            rtlTcpDestroy(streams[i].rtlClient);
+            close(streams[i].spaceFd);
+        }
+        detectorDestroy(streams[i].detector);
+        if (streams[i].dedupTable) {
+            dedupFlush(streams[i].dedupTable);
+            dedupDestroy(streams[i].dedupTable);
+        }
+        packetDecoderDestroy(streams[i].packetDecoder);
+        free(streams[i].ring);
+    }
+    close(spaceEventFd);
+    close(epollFd);
+    free(streams);
+    free(workers);
+
+    return retVal;
+}
@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "rtltcp.h"
+
+/* Multi-stream receiver. Reads any number of inputs from one thread with epoll,
+   and runs their detectors on a fixed pool of worker threads. Each stream always
+   runs on the same worker. Pulses from all streams go to stdout, as
+   [startTime, duration, streamId], where streamId is the input's position in the list.
+
+   Inputs are file or FIFO paths, unix:<path> for a local socket serving raw
+   samples (rtl_tcp style - a leading dongle header is skipped), or tcp:<host>:<port>
+   for an rtl_tcp server, which is tuned with rtlSettings (sampleRate is ignored - 
+   it's rate) and reconnected if it drops, same as a single stream.
+
+   If bus isn't NULL, pulses and the packets decoded from them are published there too.
+
+   Returns once every input has ended - never, with an rtl_tcp input. processingInit
+   must have been called. */
+typedef struct PulseBus PulseBus;
+int daemonRun(char **inputs, int nInputs, int rate, int stride, int nWorkers, PulseBus *bus,
+              const RtlTcpSettings *rtlSettings);
+
+#endif // DAEMON_H
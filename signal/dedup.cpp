@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dedup.h"
+
+// Open addressing, linear probing. Power of two. Only a handful of sensors are ever
+// in the middle of a burst at once; the table is kept under three quarters full so
+// probes stay short.
+#define DEDUP_SLOTS     64
+#define DEDUP_MAX_USED  (DEDUP_SLOTS*3/4)
+
+typedef struct {
+    bool used;
+    uint32_t sensorId;
+    uint32_t payload;
+    unsigned int repeats;
+    unsigned long long firstSeen;   // samples
+    unsigned long long lastSeen;
+    Packet packet;                  // first copy, best snr
+} DedupEntry;
+
+struct DedupTable {
+    DedupEntry entries[DEDUP_SLOTS];
+    int nUsed;
+    unsigned long long gapSamples;
+    unsigned long long maxAgeSamples;
+    DedupEmitFunc emit;
+    void *emitContext;
+};
+
+DedupTable *dedupCreate(int rate, DedupEmitFunc emit, void *emitContext)
+{
+    DedupTable *table = (DedupTable *)calloc(1, sizeof(DedupTable));
+    if (table) {
+        table->gapSamples    = (unsigned long long)rate*DEDUP_GAP_MSECS/1000;
+        table->maxAgeSamples = (unsigned long long)rate*DEDUP_MAX_AGE_MSECS/1000;
+        table->emit = emit;
+        table->emitContext = emitContext;
+    }
+    return table;
+}
+
+void dedupDestroy(DedupTable *table)
+{
+    free(table);
+}
+
+static unsigned int slotFor(uint32_t sensorId, uint32_t payload)
+{
+    uint32_t hash = sensorId*0x9E3779B1u ^ payload*0x85EBCA6Bu;
+    return (hash ^ (hash >> 16)) & (DEDUP_SLOTS - 1);
+}
+
+// Ends the entry's burst and takes it out of the table. Everything after it in its probe run
+// that could live closer to home is shifted back into the hole, so lookups never need
+// tombstones.
+static void emitEntry(DedupTable *table, unsigned int slot)
+{
+    DedupEntry *entries = table->entries;
+    unsigned int hole = slot;
+
+    if (entries[slot].repeats > 1) {
+        table->emit(table->emitContext, &entries[slot].packet, entries[slot].repeats, true);
+    }
+
+    for (unsigned int i = (slot + 1) & (DEDUP_SLOTS - 1); entries[i].used; i = (i + 1) & (DEDUP_SLOTS - 1)) {
+        unsigned int home = slotFor(entries[i].sensorId, entries[i].payload);
+        // can it move back to the hole? Only if the hole is between its home and where it is now
+        if (((i - home) & (DEDUP_SLOTS - 1)) >= ((i - hole) & (DEDUP_SLOTS - 1))) {
+            entries[hole] = entries[i];
+            hole = i;
+        }
+    }
+    entries[hole].used = false;
+    table->nUsed--;
+}
+
+static bool finished(DedupTable *table, const DedupEntry *entry, unsigned long long nowSample)
+{
+    if (nowSample <= entry->lastSeen) {
+        return false;
+    }
+    return nowSample - entry->lastSeen > table->gapSamples ||
+           nowSample - entry->firstSeen > table->maxAgeSamples;
+}
+
+void dedupExpire(DedupTable *table, unsigned long long nowSample)
+{
+    if (table->nUsed == 0) {
+        return;
+    }
+    for (unsigned int i = 0; i < DEDUP_SLOTS; ) {
+        if (table->entries[i].used && finished(table, &table->entries[i], nowSample)) {
+            emitEntry(table, i);    // NB - may shift something else into i. Look again.
+        } else {
+            i++;
+        }
+    }
+}
+
+void dedupFlush(DedupTable *table)
+{
+    for (unsigned int i = 0; i < DEDUP_SLOTS; ) {
+        if (table->entries[i].used) {
+            emitEntry(table, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void dedupAdd(DedupTable *table, const Packet *packet)
+{
+    unsigned long long now = packet->lastSample;
+    uint32_t payload = packetPayload(packet);
+    DedupEntry *entry;
+    unsigned int i;
+
+    dedupExpire(table, now);
+
+    for (i = slotFor(packet->sensorId, payload); table->entries[i].used; i = (i + 1) & (DEDUP_SLOTS - 1)) {
+        entry = &table->entries[i];
+        if (entry->sensorId == packet->sensorId && entry->payload == payload) {
+            entry->repeats++;
+            entry->lastSeen = now;
+            if (packet->snr > entry->packet.snr) {
+                entry->packet.snr = packet->snr;
+            }
+            return;
+        }
+    }
+
+    if (table->nUsed >= DEDUP_MAX_USED) {
+        // More sensors talking at once than we ever expect. Let the oldest go early.
+        unsigned int oldest = 0;
+        bool found = false;
+        for (unsigned int j = 0; j < DEDUP_SLOTS; j++) {
+            if (table->entries[j].used &&
+                (!found || table->entries[j].lastSeen < table->entries[oldest].lastSeen)) {
+                oldest = j;
+                found = true;
+            }
+        }
+        emitEntry(table, oldest);
+        // the shuffle may have opened up a slot earlier in our probe run
+        for (i = slotFor(packet->sensorId, payload); table->entries[i].used; i = (i + 1) & (DEDUP_SLOTS - 1))
+            ;
+    }
+
+    entry = &table->entries[i];
+    entry->used      = true;
+    entry->sensorId  = packet->sensorId;
+    entry->payload   = payload;
+    entry->repeats   = 1;
+    entry->firstSeen = now;
+    entry->lastSeen  = now;
+    entry->packet    = *packet;
+    table->nUsed++;
+    table->emit(table->emitContext, packet, 1, false);
+}
@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "packet.h"
+
+/* Packet dedup. Sensors send every packet several times in a row; this turns each
+   burst of identical packets (same sensor id, same payload) into the first copy, 
+   passed on straight away so alarms aren't held up, and - if there were more - a 
+   count of the copies and the best SNR among them once the burst is over. A burst is
+   over once no copy has turned up for DEDUP_GAP_MSECS, or DEDUP_MAX_AGE_MSECS after
+   it started, so a sensor that keeps sending the same thing still gets heard now and
+   then.
+
+   Time here is the detector's sample count (Packet.lastSample), which never resets,
+   not the usec timebase. Fixed size table - nothing is allocated after create. One
+   table per stream; not thread safe. */
+
+#define DEDUP_GAP_MSECS     200
+#define DEDUP_MAX_AGE_MSECS 2000
+
+// Called with the first copy (repeats 1, burstEnd false) as it arrives, and again at
+// the end of the burst if there were repeats - packet is still the first copy, with 
+// its snr replaced by the best copy's.
+typedef void (*DedupEmitFunc)(void *context, const Packet *packet, unsigned int repeats, bool burstEnd);
+
+typedef struct DedupTable DedupTable;
+
+// rate in samples/sec
+DedupTable *dedupCreate(int rate, DedupEmitFunc emit, void *emitContext);
+void dedupDestroy(DedupTable *table);
+
+// A packet from the decoder. Emits it if it's the first copy, and may emit bursts
+// that have finished.
+void dedupAdd(DedupTable *table, const Packet *packet);
+
+// Emit bursts that have finished by nowSample. Call this as samples go by, or a
+// burst sits in the table until the next packet turns up.
+void dedupExpire(DedupTable *table, unsigned long long nowSample);
+
+// Emit everything, finished or not. At end of input.
+void dedupFlush(DedupTable *table);
+
+#endif // DEDUP_H
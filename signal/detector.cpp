@@ -0,0 +1,1262 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ 
+ *  This code takes its inspiration (and a few of its lines) from
+ *  inspectrum, a tool for visualizing captured RF spectra. 
+ *  inspectrum is copyright 2015, Mike Walters <mike@flomp.net> under GPL3
+ *
+*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <math.h>
+#include <fftw3.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <float.h>
+#include <limits.h>
+
+#include "detector.h"
+#include "diaglog.h"
+
+#ifndef MAX
+#define MAX(a,b) (a>b?a:b)
+#endif 
+
+#ifndef MIN
+#define MIN(a,b) (a<b?a:b)
+#endif
+
+bool debugOutput = true;
+
+// - Detector state. 
+
+#define THRESHOLD -15.0f
+#define NOISE_THRESHOLD -50.0f
+
+// Squelch. Between messages, chunks whose time domain power is close to the noise
+// floor can skip the FFT entirely. Only used when shedding load.
+#define SQUELCH_MARGIN 2.0f         // 3dB above the noise floor
+#define NOISE_FLOOR_WEIGHT 0.01f    // weight of each new quiet chunk in the noise floor average
+
+#define INPUT_BUF_SIZE (1 << 16)    // bytes. Room for a network read's worth, for detectorInputSpace
+
+typedef enum {
+    FIRST_SYNCH,
+    TRANSITION_TO_SECOND_SYNCH,
+    SECOND_SYNCH,
+    TRANSITION_OUT_OF_SYNCH
+} eSynchState;
+
+typedef enum {
+    NO_MESSAGE,
+    SYNCHING,
+    IN_MESSAGE
+} eProcessingState;
+
+typedef enum {
+    MSG_SIGNAL,
+    MSG_NO_SIGNAL,
+    MSG_TRANSITION = 3,
+    MSG_UNKNOWN = 4
+} eSignalState;
+
+#define SYNCH_SETTLE_TIME 30
+
+typedef enum {
+    HYP_FIRST_IS_SPACE,     // space preamble, then the ~1ms signal blip
+    HYP_FIRST_IS_SIGNAL,    // preamble not seen; the first transmission is the signal blip
+    N_SYNCH_HYPOTHESES
+} eSynchHypothesis;
+
+typedef struct {
+    bool alive;
+    bool pending;                   // the blip, if it came first
+    unsigned long pendingStart;
+    unsigned long pendingDuration;
+} SynchHypothesis;
+
+// Everything we know about one stream of samples. The FFT plan and window are
+// shared by all detectors; the buffers the plan runs on are not.
+struct Detector {
+    DetectorEmitFunc emit;
+    void *emitContext;
+    
+    // raw input, so chunks can straddle the caller's reads
+    unsigned char *inputBuf;
+    int inputBufSize;
+    unsigned char *inputPtr;            // where the next input goes
+    unsigned char *readPtr;             // start of the next chunk
+    
+    fftwf_complex *fft_src;
+    fftwf_complex *fft_dst;
+    float *sampleBuffer;
+    float *dstBuffer;
+    
+    unsigned long timebase;
+    bool sampleTimebase;                // reset the timebase by the sample count, not the wall clock
+    unsigned long long timebaseSample;  // chunkStartSample at the last reset, if so
+    unsigned long sampleRate;
+    unsigned int processingStride;
+    unsigned long bytesProcessed;
+    unsigned long long chunkStartSample;    // never reset, unlike bytesProcessed
+    unsigned long prevStartTime;
+    unsigned long prevTime;
+    
+    bool bSquelch;
+    float noiseFloor;
+    unsigned long nSquelchedChunks;
+    
+    eSynchState synchState;
+    eProcessingState processingState;
+    eSignalState msgState;
+    unsigned long signalStartTime;
+    unsigned long lastTransmissionTime;
+    
+    float *firstSynchBuffer;
+    float *secondSynchBuffer;
+    float *signalSignature;
+    float *spaceSignature;
+    unsigned long firstSynchStartTime;
+    unsigned long firstSynchChangeTime; // when the first synch buffer was last retaken
+    unsigned long secondSynchStartTime;
+    SynchHypothesis synchHypotheses[N_SYNCH_HYPOTHESES];
+    bool blipOpen;              // committed to the preamble part way through the blip
+    float pulseSNR;             // dB, best chunk since the last pulse went out
+    bool pulseEmitted;
+    
+    // debug
+    float lastPeak;
+    float lastSNR;
+};
+
+
+// Convert complex unsigned char to normalized complex float
+static void convertToComplexFloat(unsigned char *src, float *dst, int nSamples)
+{
+    float *dstPtr = dst;
+    unsigned char  *srcPtr = src;
+    for (int i=0; i<nSamples; i++) {
+        const float k = 1.0f / 128.0f;
+        *dstPtr++ = (*srcPtr++ - 127.4f) * k;
+        *dstPtr++ = (*srcPtr++ - 127.4f) * k;
+    }
+}
+
+// FFT. Used by Processing
+
+static fftwf_plan fftwfPlan = NULL;
+static float *window = NULL;
+static int fftSize = 128;
+static int chunkSize = 0;  // Size of chunk, in samples.
+
+// XXX  ?? what does this do, anyway? There's a normalization across the buffer.
+static void initWindow() 
+{
+    static const double Tau = M_PI * 2.0;
+    window = (float *)malloc(fftSize * sizeof(float)); 
+    for (int i = 0; i < fftSize; i++) {
+        window[i] = 0.5f * (1.0f - cos(Tau * i / (fftSize - 1)));
+    }
+}
+
+// Write it somewhere else and rename it into place, so another copy of us starting up
+// never reads half a file
+static void exportWisdom(const char *wisdomFile)
+{
+    char tmpFile[PATH_MAX];
+
+    if (snprintf(tmpFile, sizeof(tmpFile), "%s.%d", wisdomFile, (int)getpid()) >= (int)sizeof(tmpFile) ||
+        !fftwf_export_wisdom_to_filename(tmpFile) || rename(tmpFile, wisdomFile) != 0) {
+        fprintf(stderr, "Cannot save FFTW wisdom to %s\n", wisdomFile);
+        unlink(tmpFile);
+    }
+}
+
+// The plan is made once, on scratch buffers, and executed by each detector on its
+// own buffers with fftwf_execute_dft. Executing is thread safe; planning is not.
+// FFTW_MEASURE takes a while on the small boxes, so if there's wisdom from an earlier
+// run (or from processingTune) we use that, and only plan from scratch if it's missing
+// or doesn't cover us.
+static void initFFT(int fft_Size, const char *wisdomFile)
+{
+    fftSize = fft_Size;
+    fftwf_complex *src = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
+    fftwf_complex *dst = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
+
+    if (wisdomFile && fftwf_import_wisdom_from_filename(wisdomFile)) {
+        fftwfPlan = fftwf_plan_dft_1d(fftSize, src, dst, FFTW_FORWARD, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+    }
+    if (!fftwfPlan) {
+        fftwfPlan = fftwf_plan_dft_1d(fftSize, 
+                                    src, 
+                                    dst, 
+                                    FFTW_FORWARD, 
+                                    FFTW_MEASURE);
+        if (fftwfPlan && wisdomFile) {
+            exportWisdom(wisdomFile);
+        }
+    }
+                           
+    fftwf_free(src);
+    fftwf_free(dst);
+    initWindow();
+}
+
+static void destroyFFT() 
+{
+    if (fftwfPlan) {
+        fftwf_destroy_plan(fftwfPlan);
+        fftwfPlan = NULL; 
+    }
+    if (window != NULL) { 
+        free(window);
+        window = NULL;
+    } 
+}
+
+static void getFFT(Detector *d, float *src, float *dst) 
+{                               
+    for (int i = 0; i < fftSize; i++) {
+        src[i*2]     *= window[i];
+        src[i*2 + 1] *= window[i];
+    }
+    memcpy(d->fft_src, src, fftSize*sizeof(fftwf_complex));
+    fftwf_execute_dft(fftwfPlan, d->fft_src, d->fft_dst);
+    
+    const float invFFTSize = 1.0f / fftSize;
+    const float logMultiplier = 10.0f / log2f(10.0f);
+    int k = fftSize/2; // start from the middle of the FFTW array and wrap, putting signal in the center
+    float *dstPtr = dst;
+
+    for (int i = 0; i < fftSize; i++) {
+        float real = d->fft_dst[k][0]*invFFTSize;
+        float imag = d->fft_dst[k][1]*invFFTSize;
+        float power = real*real + imag*imag;
+        float logPower = log2f(power) * logMultiplier;
+        *dstPtr++ = logPower;
+        k++;
+        if (k >= fftSize) {
+            k = 0;
+        }
+    }
+}
+
+
+bool processingInit(int fft_Size, const char *wisdomFile)
+{
+    if (!fftwfPlan) {
+        initFFT(fft_Size, wisdomFile);
+        chunkSize = fft_Size;
+    }
+    return (fftwfPlan != NULL);
+}
+
+void processingShutDown()
+{
+    destroyFFT();
+}
+
+/* processingTune
+   Try each FFTW planner level on this machine, time what each one comes up with
+   doing the detector's FFT the way the detector does it (out of place, on aligned
+   buffers), and save the fastest as wisdom for processingInit to pick up. The
+   harder levels try more of FFTW's kernels, but on a small FFT that doesn't always
+   win, and the measurement they plan with can be noisy - hence timing them all.
+   Each level's wisdom is kept as it's planned, since planning the winner again
+   wouldn't necessarily come up with the plan we timed.
+   Returns usecs per FFT with the winner, or -1. */
+
+typedef struct {
+    const char *name;
+    unsigned flags;
+} PlannerLevel;
+
+static const PlannerLevel plannerLevels[] = {
+    {"estimate",   FFTW_ESTIMATE},      // no measuring. Leaves no wisdom, so never kept
+    {"measure",    FFTW_MEASURE},       // what we do without wisdom
+    {"patient",    FFTW_PATIENT},
+    {"exhaustive", FFTW_EXHAUSTIVE}
+};
+#define N_PLANNER_LEVELS ((int)(sizeof(plannerLevels)/sizeof(plannerLevels[0])))
+#define TUNE_ROUNDS   5
+#define TUNE_FFTS     20000             // per round. Best round counts
+
+static double nowUsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000.0 + now.tv_nsec/1000.0;
+}
+
+static double timePlan(fftwf_plan plan, fftwf_complex *src, fftwf_complex *dst)
+{
+    double best = -1;
+
+    for (int round=0; round<TUNE_ROUNDS; round++) {
+        double start = nowUsecs();
+        for (int i=0; i<TUNE_FFTS; i++) {
+            fftwf_execute_dft(plan, src, dst);
+        }
+        double usecs = (nowUsecs() - start)/TUNE_FFTS;
+        if (best < 0 || usecs < best) {
+            best = usecs;
+        }
+    }
+    return best;
+}
+
+double processingTune(int fft_Size, const char *wisdomFile)
+{
+    fftwf_complex *src = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fft_Size);
+    fftwf_complex *dst = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fft_Size);
+    char *levelWisdom[N_PLANNER_LEVELS] = {NULL};
+    int best = -1;
+    double bestUsecs = -1;
+
+    if (!src || !dst) {
+        fftwf_free(src);
+        fftwf_free(dst);
+        return -1;
+    }
+    printf("Tuning %d point FFT, best of %d rounds of %d\n", fft_Size, TUNE_ROUNDS, TUNE_FFTS);
+    for (int level=0; level<N_PLANNER_LEVELS; level++) {
+        fftwf_forget_wisdom();      // NB - or every level after the first just reuses its plan
+        double planStart = nowUsecs();
+        fftwf_plan plan = fftwf_plan_dft_1d(fft_Size, src, dst, FFTW_FORWARD, plannerLevels[level].flags);
+        double planUsecs = nowUsecs() - planStart;
+        if (!plan) {
+            printf("  %-10s  no plan\n", plannerLevels[level].name);
+            continue;
+        }
+        if (plannerLevels[level].flags != FFTW_ESTIMATE) {
+            levelWisdom[level] = fftwf_export_wisdom_to_string();
+        }
+        // planning scribbles on the buffers. Give it something signal-like.
+        for (int i=0; i<fft_Size; i++) {
+            src[i][0] = (float)(rand() % 256 - 128)/128.0f;
+            src[i][1] = (float)(rand() % 256 - 128)/128.0f;
+        }
+        double usecs = timePlan(plan, src, dst);
+        printf("  %-10s  plan %8.1f ms  %7.3f usec/FFT\n", plannerLevels[level].name, planUsecs/1000, usecs);
+        if (levelWisdom[level] && (best < 0 || usecs < bestUsecs)) {
+            best = level;
+            bestUsecs = usecs;
+        }
+        fftwf_destroy_plan(plan);
+    }
+
+    if (best >= 0) {
+        // the winner's wisdom, and nothing else
+        fftwf_forget_wisdom();
+        if (fftwf_import_wisdom_from_string(levelWisdom[best])) {
+            printf("Keeping the %s plan\n", plannerLevels[best].name);
+            if (wisdomFile) {
+                exportWisdom(wisdomFile);
+            }
+        } else {
+            fprintf(stderr, "Cannot restore the %s plan's wisdom\n", plannerLevels[best].name);
+            bestUsecs = -1;
+        }
+    }
+    for (int level=0; level<N_PLANNER_LEVELS; level++) {
+        fftwf_free(levelWisdom[level]);
+    }
+    fftwf_free(src);
+    fftwf_free(dst);
+    return bestUsecs;
+}
+
+
+// - Processing. 
+
+static void resetProcessingState(Detector *d);
+static bool findTransmission(float *buffer, int bufferLen, int *peak, float *s2nr, float *snr);
+
+Detector *detectorCreate(int rate, int stride, DetectorEmitFunc emit, void *emitContext)
+{
+    Detector *d;
+    
+    if (!fftwfPlan) {
+        fprintf(stderr, "Processing not initialized\n");
+        return NULL;
+    }
+    d = (Detector *)calloc(1, sizeof(Detector));
+    if (!d) {
+        return NULL;
+    }
+    d->emit = emit;
+    d->emitContext = emitContext;
+    d->fft_src = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
+    d->fft_dst = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
+    d->sampleBuffer = (float *)malloc(chunkSize * 2 * sizeof(float));
+    d->dstBuffer    = (float *)malloc(chunkSize * sizeof(float));
+    d->firstSynchBuffer  = (float *)malloc(chunkSize * sizeof(float));
+    d->secondSynchBuffer = (float *)malloc(chunkSize * sizeof(float));
+    d->inputBufSize = MAX(chunkSize*2*4, INPUT_BUF_SIZE);
+    d->inputBuf = (unsigned char *)malloc(d->inputBufSize);
+    d->inputPtr = d->inputBuf;
+    d->readPtr  = d->inputBuf;
+    if (!d->fft_src || !d->fft_dst || !d->sampleBuffer || !d->dstBuffer || 
+        !d->firstSynchBuffer || !d->secondSynchBuffer || !d->inputBuf) {
+        detectorDestroy(d);
+        return NULL;
+    }
+    d->timebase = 0;
+    d->sampleRate = rate;
+    d->processingStride = stride;
+    resetProcessingState(d);
+    return d;
+}
+
+void detectorDestroy(Detector *d)
+{
+    if (!d) {
+        return;
+    }
+    if (d->fft_src) {
+        fftwf_free(d->fft_src);
+    }
+    if (d->fft_dst) {
+        fftwf_free(d->fft_dst);
+    }
+    free(d->sampleBuffer);
+    free(d->dstBuffer);
+    free(d->firstSynchBuffer);
+    free(d->secondSynchBuffer);
+    free(d->inputBuf);
+    free(d);
+}
+
+// The stride must match the distance the caller moves between chunks, or time drifts
+void detectorSetStride(Detector *d, int stride)
+{
+    d->processingStride = stride;
+}
+
+void detectorSetSampleTimebase(Detector *d, bool sampleTimebase)
+{
+    d->sampleTimebase = sampleTimebase;
+    // The wall clock timebase starts at 0, so it resets at the first quiet chunk. Do the
+    // same here, so a capture gets the same times either way.
+    d->timebaseSample = d->chunkStartSample - 5ULL*d->sampleRate - 1;
+}
+
+void detectorSetSquelch(Detector *d, bool squelch)
+{
+    // The noise floor is only tracked while squelching. Whatever we had is stale
+    if (squelch && !d->bSquelch) {
+        d->noiseFloor = 0;
+    }
+    d->bSquelch = squelch;
+}
+
+unsigned long detectorSquelchedChunks(Detector *d)
+{
+    return d->nSquelchedChunks;
+}
+
+
+static void emitSignal(Detector *d, int startTime, int duration)
+{
+    // Pulses can go out well after they end (synch), so work the end sample out from the
+    // end time. chunkStartSample catches up with the clock once this chunk is done.
+    unsigned long long timebaseOrigin = d->chunkStartSample + d->processingStride - d->bytesProcessed;
+    unsigned long long endSample = timebaseOrigin + (unsigned long long)(startTime + duration)*d->sampleRate/1000000;
+    
+    d->emit(d->emitContext, startTime, duration, endSample > 0 ? endSample - 1 : 0, d->pulseSNR);
+    d->pulseEmitted = true;
+}
+
+float s2nrThreshold = 0.50f;  // XXX nfc what this should be. Check empirically
+
+// XXX - I could find the transmission frequency empirically, just by looking at what it
+// is over time. Later.
+
+static bool transmissionPresent(Detector *d, float *buffer, int bufferLen)
+{
+    // Go through buffer, looking for a signal that rises
+    // above the average power
+    int peak;
+    float s2nr, snr;
+    
+    // Pulses committed together (end of synch) all get the same SNR. Close enough.
+    if (d->pulseEmitted) {
+        d->pulseSNR = 0;
+        d->pulseEmitted = false;
+    }
+    if( findTransmission(buffer, bufferLen, &peak, &s2nr, &snr) ){
+        //fprintf(stderr, "Peak at %d\n", peak); // XXX DEBUG only
+        d->lastPeak = peak;
+        d->lastSNR = s2nr;
+        if (s2nr < s2nrThreshold) { // since power is negative, the snr threshold points this way
+            d->pulseSNR = MAX(d->pulseSNR, snr);
+            return true;
+        }
+        return false;
+    } else {
+        return false;
+    }
+}
+
+/*
+With this version, I'm just comparing total power. This is not very useful for comparing
+different spectra with similar power, or for comparing random noise with random noise 
+*/
+/*
+static float signalDifferential(float *buffer1, float *buffer2, int bufferLen) 
+{
+    //float diffBuf[bufferLen]; 
+    //float *diffBufPtr = diffBuf;
+    float *buffer1Ptr = buffer1;
+    float *buffer2Ptr = buffer2;
+    float cumDif = 0;
+    
+    for (int i=0; i<bufferLen; i++) {
+        float diff = *buffer1Ptr++ - *buffer2Ptr++;  // intentionally signed. random errors should cancel.
+   //     *diffBufPtr++ = diff;
+        cumDif += diff;
+    }
+    // For the moment, I'll just use the cumulative differential
+    printf("Signal Differential is %f\n", cumDif/bufferLen);
+    return cumDif/bufferLen;
+}
+*/
+
+
+// Slightly different version - compare snr for the two buffers
+static float signalDifferential(float *buffer1, float *buffer2, int bufferLen) 
+{
+    int peak1, peak2;
+    float snr1, snr2;
+    bool hasTransmission1, hasTransmission2;
+    float retVal = 1.0f;
+    
+    hasTransmission1 = findTransmission(buffer1, bufferLen, &peak1, &snr1, NULL);
+    hasTransmission2 = findTransmission(buffer2, bufferLen, &peak2, &snr2, NULL);
+        
+    // signal differential is snr/snr, for with smaller snr as numerator, larger
+    // as denominator, if we have transmissions for both
+    if (hasTransmission1 && hasTransmission2) {
+        float snrMax = MAX(snr1,snr2);
+        float snrMin = MIN(snr1,snr2);
+        retVal = snrMin/snrMax;
+    // If there is only a transmission for one of them, return 0.1
+    } else if (hasTransmission1 || hasTransmission2) {
+        retVal = 0.1;
+    // If there is a transmission for neither, return 1.0
+    } else {
+       retVal = 1.0;
+    } 
+    
+//    printf("Signature differential is %f\n", retVal);
+    return retVal;
+}
+
+
+
+#define INITIAL_SPACE_MIN 30000
+#define INITIAL_SPACE_MAX 60000
+#define INITIAL_SIGNAL_MIN 800
+#define INITIAL_SIGNAL_MAX 1200
+#define INITIAL_GAP_MAX 500     // the space after the signal blip is no longer than any other space in the packet
+#define MIN_SYNCH_LEN INITIAL_SIGNAL_MIN    // shortest first transmission - the blip. The preamble's longer
+
+//#define ID_THRESHOLD 35.f // XXX I have no idea how big this should be
+#define ID_THRESHOLD 0.8f // XXX I have no idea how big this should be
+
+#define END_MSG_TIMEOUT 1000 // 1 millisecond without a signal is considered to be the end of a transmission
+#define SYNCH_DROPOUT_TIME 100 // a weak preamble drops out for a chunk or two. Don't take that as its end
+
+static int identifyBuffer(Detector *d, float *buffer, int bufferLen)
+{
+    if (bufferLen != fftSize) {
+        fprintf(stderr, "Unexpected buffer size!\n");
+        return MSG_UNKNOWN;
+    }
+    // Attempt to figure out what this buffer represents - signal, space between signals, 
+    // or a transitional state. Note that I'm changing the order in which I do the comparisons
+    // depending on the current state, since the buffer will almost always be the same
+    // type as the previous one.
+    if (d->msgState == MSG_SIGNAL) {
+        if (d->signalSignature && signalDifferential(buffer, d->signalSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_SIGNAL;
+//} else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
+//            return MSG_TRANSITION;
+        } else if (d->spaceSignature && signalDifferential(buffer, d->spaceSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_NO_SIGNAL;
+        } else {
+            return MSG_UNKNOWN;
+        }
+    } else if (d->msgState == MSG_NO_SIGNAL) {
+        if (d->spaceSignature && signalDifferential(buffer, d->spaceSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_NO_SIGNAL;
+//        } else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
+//            return MSG_TRANSITION;
+        } else if (d->signalSignature && signalDifferential(buffer, d->signalSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_SIGNAL;
+        } else {
+            return MSG_UNKNOWN;
+        }
+    } else if (d->msgState == MSG_TRANSITION || d->msgState == MSG_UNKNOWN) {
+        if (d->signalSignature && signalDifferential(buffer, d->signalSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_SIGNAL;
+//        } else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
+//            return MSG_TRANSITION;
+        } else if (d->spaceSignature && signalDifferential(buffer, d->spaceSignature, bufferLen) > ID_THRESHOLD) {
+            return MSG_NO_SIGNAL;
+        } else {
+            return MSG_UNKNOWN;
+        }
+    }
+    
+    return MSG_UNKNOWN;
+}
+
+/* processBuffer -
+   Take an incoming buffer with data in the frequency domain, and call emitSignal if 
+   needed. In order to emit a signal, we must know both the start of the signal and the 
+   duration of the signal, so we need to track state transitions between signalling and 
+   non-signalling.
+   
+   The process of tracking transitions is somewhat complicated because empirically, the 
+   spectrum received appears to have four distinct states*, and not all of them 
+   necessarily appear in each data packet.
+   
+   To add to the complexity, although the signatures of these states are consistent 
+   across a single data packet transmission, they can vary wildly depending on the 
+   particular transmitter, radio, and distance between the two. The same equipment in the 
+   same geometric configuration can even show differences in received transmission 
+   signatures for packets sent a few seconds apart. 
+   
+   To deal with all of this, I introduce a fairly complex state machine and incorporate
+   some logic specific to the GE Wireless sensors.**  In particular, a few milliseconds 
+   before the beginning of the data bits, the radio puts out a signature equivalent to the
+   'space' between actual signals. (Depending on the distance between the radio and the 
+   transmitter, however, this transmission may or may not be distinguishable from the 
+   background noise.) After this signature there is always an approximately 1ms 
+   transmission in the 'signalled' state. Therefor, in order to figure out what is signal 
+   and what is space, I look at the first two transmissions in the packet. Whichever 
+   transmission is about 1ms long is signal, the other is space. Both possibilities are
+   tracked from the first transition, so that we can commit as soon as the timing rules
+   one of them out.
+   
+   * Signalled, non-signalled, transitional, and background. There's always a visible
+   frequency spike in the signalled state. Non-signalled and transitional states may
+   look like background noise.
+   
+   ** I'm sad about having to bring this high-level knowledge of the protocol down into
+     this low-level routine. The core problem is that I can't know whether the start of
+     the transmission represents signal or space. Perhaps there's a better way than 
+     matching the initial data to what I expect to see from the GE Sensors - maybe, for
+     instance, the transmission is always significantly stronger during a signal than 
+     during a space.   
+*/
+
+
+static void resetProcessingState(Detector *d)
+{
+    d->synchState = FIRST_SYNCH;
+    d->processingState = NO_MESSAGE;
+    d->msgState = MSG_NO_SIGNAL;
+    d->pulseSNR = 0;
+    d->blipOpen = false;
+}
+
+/* GE synch hypotheses
+   GE-specific code here. From the first transition in a packet we can't know
+   whether the first transmission is the 'space' preamble or the ~1ms signal
+   blip (the preamble may be lost in the background noise). Rather than waiting
+   for both transmissions to complete before deciding, we track both possibilities
+   in parallel, holding on to the blip if it came first, and commit to whichever one
+   survives the GE timing constraints first. If that's the preamble, we're still in
+   the blip, and IN_MESSAGE finishes it off. 
+   
+   Note that we could create other similar functions for other sensors,
+   or we could replace this with something more general */
+
+static bool GE_IsInitialSignal(unsigned long duration)
+{
+    return (duration >= INITIAL_SIGNAL_MIN && duration <= INITIAL_SIGNAL_MAX);
+}
+
+static void resetHypotheses(Detector *d)
+{
+    for (int i=0; i<N_SYNCH_HYPOTHESES; i++) {
+        d->synchHypotheses[i].alive = true;
+        d->synchHypotheses[i].pending = false;
+    }
+}
+
+static void addTentativePulse(Detector *d, eSynchHypothesis hyp, unsigned long startTime, unsigned long duration)
+{
+    SynchHypothesis *h = &d->synchHypotheses[hyp];
+    h->pendingStart    = startTime;
+    h->pendingDuration = duration;
+    h->pending = true;
+}
+
+/* commitHypothesis
+   Make the given hypothesis the truth - set the signal and space signatures,
+   flush its tentative pulse, and move on to processing the message. 'atBoundary'
+   is true if the second transmission has just ended, false if we're still in it - 
+   which can only be the blip, after the preamble, so it's left open for IN_MESSAGE
+   to emit (or throw out, if it doesn't end in time) */
+static void commitHypothesis(Detector *d, eSynchHypothesis hyp, unsigned long curTime, bool atBoundary)
+{
+    SynchHypothesis *h = &d->synchHypotheses[hyp];
+    bool secondIsSignal = (hyp == HYP_FIRST_IS_SPACE);
+    
+    logEvent(LOG_SYNCH_COMMIT, curTime, 0, 0, secondIsSignal, 0);
+    
+    if (secondIsSignal) {
+        d->spaceSignature  = d->firstSynchBuffer;
+        d->signalSignature = d->secondSynchBuffer;        
+    } else {
+        d->spaceSignature  = d->secondSynchBuffer;
+        d->signalSignature = d->firstSynchBuffer; 
+    }
+    
+    if (h->pending) {
+        emitSignal(d, h->pendingStart, h->pendingDuration);
+        h->pending = false;
+    }
+    
+    // If we're still in the second transmission, that's what we're looking at. Otherwise
+    // we've just crossed into its opposite.
+    if (secondIsSignal != atBoundary) {
+        d->msgState = MSG_SIGNAL;
+        d->signalStartTime = atBoundary ? curTime : d->secondSynchStartTime;
+    } else {
+        d->msgState = MSG_NO_SIGNAL;
+    }
+    d->blipOpen = !atBoundary;
+    d->processingState = IN_MESSAGE;
+}
+
+/* openHypotheses
+   Called at the first transition in the packet. The first transmission is complete,
+   so we know whether it could have been the signal blip. If it's too long for that
+   timed from the start but not from where its signature changed, what came before
+   the change was a scrap of preamble. */
+static void openHypotheses(Detector *d, unsigned long curTime)
+{
+    unsigned long firstSynchDuration = curTime - d->firstSynchStartTime;
+    
+    if (!GE_IsInitialSignal(firstSynchDuration) && GE_IsInitialSignal(curTime - d->firstSynchChangeTime)) {
+        d->firstSynchStartTime = d->firstSynchChangeTime;
+        firstSynchDuration = curTime - d->firstSynchStartTime;
+    }
+    resetHypotheses(d);
+    d->secondSynchStartTime = curTime;
+    d->synchState = SECOND_SYNCH;
+    
+    if (GE_IsInitialSignal(firstSynchDuration)) {
+        addTentativePulse(d, HYP_FIRST_IS_SIGNAL, d->firstSynchStartTime, firstSynchDuration);
+    } else {
+        d->synchHypotheses[HYP_FIRST_IS_SIGNAL].alive = false;
+    }
+}
+
+/* slideSynchWindow
+   Neither hypothesis fits the first two transmissions. Rather than throwing away
+   the packet, assume we started synching on something that wasn't the preamble, 
+   and synch again from the start, on the transmission we're in. If the second 
+   transmission has just ended that's the next one; otherwise it's the second, which
+   has run too long to be the signal blip (so may well be the preamble). Either way
+   the first synch buffer is taken again - the old ones may have caught an edge. */
+static void slideSynchWindow(Detector *d, unsigned long curTime, bool atBoundary)
+{
+    logEvent(LOG_SYNCH_SLIP, curTime, 0, 0, 0, 0);
+    resetHypotheses(d);
+    d->firstSynchStartTime = atBoundary ? curTime : d->secondSynchStartTime;
+    d->synchState = FIRST_SYNCH;
+}
+
+// Both still possible means we're in the second transmission, and the first could
+// have been the signal blip. A quiet second transmission is the space after the
+// blip, not the end of the packet, and the timing will settle it by INITIAL_SIGNAL_MAX.
+static bool hypothesesOpen(Detector *d)
+{
+    return (d->synchState == SECOND_SYNCH || d->synchState == TRANSITION_OUT_OF_SYNCH) &&
+           d->synchHypotheses[HYP_FIRST_IS_SPACE].alive && d->synchHypotheses[HYP_FIRST_IS_SIGNAL].alive;
+}
+
+/* GE_ResolveHypotheses
+   Kill any hypothesis the GE timing constraints rule out, and commit as soon as 
+   only one remains - for the preamble, that's once the second transmission has gone
+   on longer than the space after the blip, well before the blip ends. Called for every
+   buffer while in the second transmission, and once more when it ends. */
+static void GE_ResolveHypotheses(Detector *d, unsigned long curTime, bool atBoundary)
+{
+    SynchHypothesis *spaceFirst  = &d->synchHypotheses[HYP_FIRST_IS_SPACE];
+    SynchHypothesis *signalFirst = &d->synchHypotheses[HYP_FIRST_IS_SIGNAL];
+    unsigned long secondSynchDuration = curTime - d->secondSynchStartTime;
+    
+    // If the preamble came first, the second transmission is the signal blip
+    if (spaceFirst->alive) {
+        if (atBoundary && GE_IsInitialSignal(secondSynchDuration)) {
+            addTentativePulse(d, HYP_FIRST_IS_SPACE, d->secondSynchStartTime, secondSynchDuration);
+            commitHypothesis(d, HYP_FIRST_IS_SPACE, curTime, atBoundary);
+            return;
+        } else if (atBoundary || secondSynchDuration > INITIAL_SIGNAL_MAX) {
+            spaceFirst->alive = false;
+        }
+    } 
+    
+    // If the signal blip came first, the second transmission is the short space after it
+    if (signalFirst->alive && secondSynchDuration > INITIAL_GAP_MAX) {
+        signalFirst->alive = false;
+    }
+    
+    if (spaceFirst->alive && secondSynchDuration <= INITIAL_GAP_MAX) {
+        // nop. Still undecided. Even if signal-first was never on, the second synch buffer 
+        // may have caught the edge of the blip, and it'll look like it's ended early.
+    } else if (spaceFirst->alive) {
+        // Too long for the space after the blip, so it's the blip itself. Don't wait for it to end.
+        commitHypothesis(d, HYP_FIRST_IS_SPACE, curTime, atBoundary);
+    } else if (signalFirst->alive) {
+        commitHypothesis(d, HYP_FIRST_IS_SIGNAL, curTime, atBoundary);
+    } else {
+        logEvent(LOG_PACKET_ERROR, curTime, 0, 0, 
+                 d->secondSynchStartTime - d->firstSynchStartTime, secondSynchDuration);
+        slideSynchWindow(d, curTime, atBoundary);
+    }
+}
+
+/* GE_CheckOpenBlip
+   After an early commit to the preamble, IN_MESSAGE is in the middle of the blip.
+   Make sure it ends in time - if not, we committed on something that wasn't the 
+   preamble, and we go back to synching as GE_ResolveHypotheses would have. Returns
+   whether we're still in the message. */
+static bool GE_CheckOpenBlip(Detector *d, unsigned long curTime, bool atBoundary)
+{
+    unsigned long duration = curTime - d->signalStartTime;
+    
+    if (!d->blipOpen) {
+        return true;
+    }
+    if (atBoundary ? GE_IsInitialSignal(duration) : duration <= INITIAL_SIGNAL_MAX) {
+        d->blipOpen = !atBoundary;
+        return true;
+    }
+    logEvent(LOG_PACKET_ERROR, curTime, 0, 0, d->secondSynchStartTime - d->firstSynchStartTime, duration);
+    d->blipOpen = false;
+    d->processingState = SYNCHING;
+    slideSynchWindow(d, curTime, atBoundary);
+    return false;
+}
+
+static unsigned long advanceClock(Detector *d)
+{
+    unsigned long curTime;
+    
+    d->bytesProcessed += d->processingStride; 
+    curTime = d->bytesProcessed/(((float)d->sampleRate)/1000000);
+    if (curTime < d->prevTime && debugOutput) printf("WRAP\n");
+    d->prevTime = curTime;   
+    return curTime;
+}
+
+static void checkTimebase(Detector *d)
+{
+    // Offline, go by the samples - the answer mustn't depend on how fast we're fed
+    if (d->sampleTimebase) {
+        if (d->chunkStartSample - d->timebaseSample > 5ULL*d->sampleRate) {
+            d->timebaseSample = d->chunkStartSample;
+            d->bytesProcessed = 0;
+        }
+        return;
+    }
+    // reset d->timebase if it's been more than 5 seconds since the previous signal
+    if (time(0) - d->timebase > 5) {
+        d->timebase = time(0);
+        if (debugOutput) {
+            printf("TIMEBASE RESET, time is %lu\n", d->timebase);
+        }
+        d->bytesProcessed = 0;
+    }
+}
+
+// Returns whether there was a transmission in the buffer
+static bool processBuffer(Detector *d, float *buffer, int bufferLen)
+{
+    bool transmitting = transmissionPresent(d, buffer, bufferLen);
+    int signalType; 
+    unsigned long curTime = advanceClock(d);
+ 
+    // make note of the last time we saw a transmission. This is used to change the 
+    // state at the end of a message
+    if (transmitting) {
+        d->lastTransmissionTime = curTime;
+    }
+    
+//    fprintf(stderr, "Processing state is %d,transmitting %d, d->synchState %d, curtime %d\n", d->processingState, transmitting, d->synchState, curTime);
+    
+    switch (d->processingState) {
+    case NO_MESSAGE:
+        if (!transmitting) {
+            checkTimebase(d);
+        } else {
+            //fprintf(stderr, "Detected message, %lu\n", curTime);
+            // Beginning of a message. Start the synching process.
+            d->firstSynchStartTime = curTime;
+            d->processingState = SYNCHING;
+            d->synchState = FIRST_SYNCH;
+            if (curTime < d->prevStartTime && debugOutput) printf("CSW WRAP!\n");
+            d->prevStartTime = curTime;
+            logEvent(LOG_MESSAGE_START, curTime, d->lastPeak, d->lastSNR, 0, 0);
+        }
+        break;
+    case IN_MESSAGE:
+        // is this space or signal? 
+        if (!transmitting) {
+            signalType = MSG_NO_SIGNAL;
+            //fprintf(stderr, "no signal\n");
+        } else {
+            signalType = identifyBuffer(d, buffer, bufferLen);
+            //fprintf(stderr, "Signal type is %d\n", signalType);
+        } 
+        
+        //fprintf(stderr, "Diff time is %lu\n", curTime - d->lastTransmissionTime);
+        //fprintf(stderr, "cur time %lu, last trans time %lu\n", curTime, d->lastTransmissionTime);
+        
+        // quick check - has the message ended? If so, change state and immediately break
+        if ((signalType == MSG_NO_SIGNAL || signalType == MSG_UNKNOWN) && 
+            (curTime - d->lastTransmissionTime > END_MSG_TIMEOUT)) {
+            logEvent(LOG_MESSAGE_END, curTime, 0, 0, 0, 0);
+            resetProcessingState(d); 
+            break;
+        } 
+        
+        
+        // normal flow - emit signal on state change, otherwise nop
+        switch (d->msgState){
+        case MSG_SIGNAL:
+            if (signalType == MSG_NO_SIGNAL) {
+                // state changes. Emit current signal.
+                d->msgState = MSG_NO_SIGNAL;
+                if (GE_CheckOpenBlip(d, curTime, true)) {
+                    emitSignal(d, d->signalStartTime, curTime - d->signalStartTime);
+                }
+            } else {
+                // nop. Treat 'unknown' and 'transition' as part of the signal.
+                GE_CheckOpenBlip(d, curTime, false);
+            }
+            break;
+        case MSG_NO_SIGNAL:
+            if (signalType == MSG_SIGNAL) {
+                logEvent(LOG_FOUND_SIGNAL, curTime, d->lastPeak, d->lastSNR, 0, 0);
+                // state changes. Set signal start time
+                d->msgState = MSG_SIGNAL;
+                d->signalStartTime = curTime;
+            } else {
+                // nop. Treat 'unknown' and 'transition' as part of the space
+            } 
+            break;
+        default:
+            break;
+        }
+        break;
+    case SYNCHING:
+        // Nothing resolves a synch that has gone quiet. Give up on it.
+        if (!transmitting && (curTime - d->lastTransmissionTime > END_MSG_TIMEOUT) && !hypothesesOpen(d)) {
+            logEvent(LOG_SYNCH_LOST, curTime, 0, 0, 0, 0);
+            resetProcessingState(d);
+            break;
+        }
+        
+        switch (d->synchState) {
+        case FIRST_SYNCH:
+            if (curTime - d->firstSynchStartTime >= SYNCH_SETTLE_TIME) {
+                if (transmitting) {
+                    memcpy(d->firstSynchBuffer, buffer, bufferLen*sizeof(float));
+                    d->firstSynchChangeTime = d->firstSynchStartTime;
+                    d->synchState = TRANSITION_TO_SECOND_SYNCH;    
+                    logEvent(LOG_FIRST_SYNCH, curTime, 0, 0, 0, 0);
+                    logEvent(LOG_SYNC_SIGNAL, curTime, d->lastPeak, d->lastSNR, 0, 0);
+                } else {
+                    //fprintf(stderr, "signal inconsistency in first sync\n"); // XXX - it may be better to just ignore this, or have it be only a special debug printf.
+                    // Whatever started the synch has dropped out. Time the first transmission from when it comes back
+                    d->firstSynchStartTime = curTime;
+                }
+            } else {
+                // nop. Settling after transition to first sync.
+            }
+            break;
+        case TRANSITION_TO_SECOND_SYNCH:
+            if (!transmitting && curTime - d->lastTransmissionTime > SYNCH_DROPOUT_TIME) {
+                if (d->lastTransmissionTime - d->firstSynchStartTime < MIN_SYNCH_LEN) {
+                    // Too short to be anything GE starts a packet with. Start over.
+                    logEvent(LOG_SYNCH_LOST, curTime, 0, 0, 0, 0);
+                    resetProcessingState(d);
+                } else {
+                    logEvent(LOG_SECOND_SYNCH, curTime, 0, 0, 0, 0);
+                    openHypotheses(d, d->lastTransmissionTime);
+                }
+            } else if (!transmitting) {
+                // nop. Dropout - wait and see if it comes back
+            } else if (curTime - d->firstSynchStartTime < MIN_SYNCH_LEN) {
+                // Nothing GE starts a packet with is this short. If it already looks
+                // different, the first synch buffer caught the edge of the transmission
+                // (chunks are longer than the settle time), or a scrap of preamble just 
+                // before the blip - take it again. openHypotheses sorts out which.
+                if (signalDifferential(d->firstSynchBuffer, buffer, bufferLen) < ID_THRESHOLD) {
+                    memcpy(d->firstSynchBuffer, buffer, bufferLen*sizeof(float));
+                    d->firstSynchChangeTime = curTime;
+                }
+            } else if (signalDifferential(d->firstSynchBuffer, buffer, bufferLen) < ID_THRESHOLD) { // XXX may want the threshold bigger here?
+                logEvent(LOG_SECOND_SYNCH, curTime, 0, 0, 0, 0);
+                openHypotheses(d, curTime);
+            } else {
+                // nop. Haven't found the transition point yet.
+            }
+            break;
+        case SECOND_SYNCH:
+            if (curTime - d->secondSynchStartTime >= SYNCH_SETTLE_TIME) {
+                memcpy(d->secondSynchBuffer, buffer, bufferLen*sizeof(float));
+                d->synchState = TRANSITION_OUT_OF_SYNCH;
+                logEvent(LOG_SYNC_SIGNAL, curTime, d->lastPeak, d->lastSNR, 0, 0);
+            } else {
+                // nop. Settling after transition to second sync
+            }
+            break;
+        case TRANSITION_OUT_OF_SYNCH:
+            if (signalDifferential(d->secondSynchBuffer, buffer, bufferLen) < ID_THRESHOLD) { // XXX may want the threshold bigger here?
+                logEvent(LOG_CHECK_SYNCHS, curTime, 0, 0, 0, 0);
+                GE_ResolveHypotheses(d, curTime, true);
+            } else {
+                // Haven't found the transition point yet, but timing alone may decide it
+                GE_ResolveHypotheses(d, curTime, false);
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+    return transmitting;
+}
+
+#define SLIDING_WINDOW_SIZE 2  // XXX check experimentally
+// s2nr is the peak window's power over the rest of the spectrum's, both in (negative) dB,
+// so smaller is stronger. snr is the same thing as a difference - dB above the rest.
+static bool findTransmission(float *buffer, int bufferLen, int *peak, float *s2nr, float *snr)
+{
+    //float slidingWindow[SLIDING_WINDOW_SIZE]; // XXX this is a better optimization... Do I need it?
+    float *bufferPtr = buffer;
+    float maxWindowPower = -FLT_MAX;   // maximum power in any particular window
+    float accPower = 0;   // total power in the spectrum
+    int transmissionFreqStart = 0;
+    
+    if (bufferLen <= SLIDING_WINDOW_SIZE){
+        return false;
+    }
+    
+    // go through all the sliding windows, looking for the one that has the highest
+    // total power. Also sum the power in the buffer
+    for (int j=0; j<bufferLen-SLIDING_WINDOW_SIZE; j++){
+        bufferPtr = &buffer[j];
+        accPower += *bufferPtr;
+        
+        float windowPower = 0; 
+        for (int i=0; i<SLIDING_WINDOW_SIZE; i++){
+            windowPower += *bufferPtr++; 
+        }
+        if (windowPower > maxWindowPower) {
+            maxWindowPower = windowPower;
+            transmissionFreqStart = j;
+        }
+    }
+    
+    // finish summing the power in the buffer for the last SLIDING_WINDOW_SIZE samples
+    bufferPtr = &buffer[bufferLen - SLIDING_WINDOW_SIZE];
+    for (int i=0; i<SLIDING_WINDOW_SIZE; i++) {
+        accPower += *bufferPtr++;
+    }
+    
+    // When calculating the average power, I want the average *outside* of the peak window.
+    // So subtract that from accPower
+    accPower -= maxWindowPower;
+    
+    float averagePower = accPower/(bufferLen - SLIDING_WINDOW_SIZE);
+    float peakPower    = maxWindowPower/SLIDING_WINDOW_SIZE;
+    
+    // for debug at least - find and print peak in window...
+/*    float localMaxima = -FLT_MAX;
+    bufferPtr = &buffer[transmissionFreqStart];
+    for (int i=0; i<SLIDING_WINDOW_SIZE; i++) {
+        localMaxima = MAX(localMaxima, *bufferPtr++);
+    }*/
+//    fprintf(stderr, "DEBUG - window maxima is %f, window power is %f\n", localMaxima, peakPower);
+//    fprintf(stderr, "DEBUG - accPower is %f\n", accPower);
+//    fprintf(stderr, "DEBUG - snr is %f, average power is %f\n", peakPower/averagePower, averagePower);
+
+    
+    if (s2nr) {
+        *s2nr = peakPower/averagePower;
+    }
+    if (snr) {
+        *snr = peakPower - averagePower;
+    }
+    if (peak) {
+        *peak = transmissionFreqStart + SLIDING_WINDOW_SIZE/2;
+    }
+    
+    return true;
+}
+
+#if 0
+static bool signalPresent(float *buffer, int bufferLen) 
+{
+    float runningTotal = 0;
+    int nNonSignalPoints = 0;
+    float max = *buffer;
+    float min = max;
+    float *bufferPtr = buffer;
+    // walk through buffer, looking for value that exceeds THRESHOLD
+    for (int i=0; i<bufferLen; i++) {
+        float curVal = *bufferPtr++;
+        if (curVal < THRESHOLD) {
+            nNonSignalPoints++;
+            runningTotal += curVal;
+        }
+        if (curVal  > max) {
+            max = curVal;
+        }
+        if (curVal < min) {
+            min = curVal;
+        }
+    }
+/*    if (max > THRESHOLD) {
+        fprintf(stderr, "Average is %f\n", runningTotal/nNonSignalPoints);
+        fprintf(stderr, "Max is %f, min is %f\n", max, min);
+    }
+*/
+    return ((max > THRESHOLD) && nNonSignalPoints > 0 && runningTotal/nNonSignalPoints < NOISE_THRESHOLD);
+}
+#endif //0
+
+
+// Average time domain power of a chunk of raw samples
+static float chunkPower(unsigned char *src, int nSamples)
+{
+    float acc = 0;
+    for (int i=0; i<nSamples*2; i++) {
+        float v = src[i] - 127.4f;
+        acc += v*v;
+    }
+    return acc/nSamples;
+}
+
+void detectorProcessChunk(Detector *d, unsigned char *charBuffer)
+{
+
+    bool idle = (d->processingState == NO_MESSAGE);
+    float power = 0;
+    
+    // power's only needed for the squelch, so don't pay for it on every chunk
+    if (d->bSquelch) {
+        power = chunkPower(charBuffer, chunkSize);
+    }
+    if (d->bSquelch && idle && d->noiseFloor > 0 && power < d->noiseFloor*SQUELCH_MARGIN) {
+        d->nSquelchedChunks++;
+        advanceClock(d);
+        checkTimebase(d);
+        d->chunkStartSample += d->processingStride;
+        return;
+    }
+    
+    convertToComplexFloat(charBuffer, d->sampleBuffer, chunkSize);
+    getFFT(d, d->sampleBuffer, d->dstBuffer);
+    bool transmitting = processBuffer(d, d->dstBuffer, chunkSize);
+    
+    // track the noise floor while nothing is going on
+    if (d->bSquelch && idle && !transmitting) {
+        if (d->noiseFloor == 0) {
+            d->noiseFloor = power;
+        } else {
+            d->noiseFloor += (power - d->noiseFloor)*NOISE_FLOOR_WEIGHT;
+        }
+    }
+    d->chunkStartSample += d->processingStride;
+}
+
+/* detectorSkip
+   The input has a hole in it - nSamples went by that we'll never see. Keep the clock
+   right, and drop anything that straddles the hole: the partial chunk, and whatever 
+   message was in progress. */
+void detectorSkip(Detector *d, unsigned long long nSamples)
+{
+    // NB - readPtr can be past inputPtr if the stride is larger than a chunk, in which
+    // case the clock has already moved on a little way into the hole
+    nSamples += (d->inputPtr - d->readPtr)/2;
+    d->inputPtr = d->inputBuf;
+    d->readPtr  = d->inputBuf;
+    d->bytesProcessed   += nSamples;
+    d->chunkStartSample += nSamples;
+    resetProcessingState(d);
+}
+
+/* detectorFeed
+   Take an arbitrary amount of input and process every complete chunk in it. Chunks 
+   overlap (they're chunkSize long, and 'stride' apart), so whatever is left over is
+   kept for the next call. */
+void detectorFeed(Detector *d, const unsigned char *data, int len)
+{
+    while (len > 0) {
+        int room;
+        unsigned char *space = detectorInputSpace(d, &room);
+        int n = MIN(len, room);
+        memcpy(space, data, n);
+        detectorInputDone(d, n, 0);
+        data += n;
+        len  -= n;
+    }
+}
+
+unsigned char *detectorInputSpace(Detector *d, int *len)
+{
+    *len = (int)((d->inputBuf + d->inputBufSize) - d->inputPtr);
+    return d->inputPtr;
+}
+
+void detectorInputDone(Detector *d, int len, unsigned long long samplesLost)
+{
+    if (samplesLost) {
+        // the hole comes before what was just read. Skipping empties the buffer.
+        unsigned char *data = d->inputPtr;
+        detectorSkip(d, samplesLost);
+        memmove(d->inputPtr, data, len);
+    }
+    d->inputPtr += len;
+    
+    while (d->inputPtr - d->readPtr >= chunkSize*2) {  // NB - samples are complex, two bytes
+        detectorProcessChunk(d, d->readPtr);
+        d->readPtr += d->processingStride*2;
+    }
+    
+    // out of room. Move the leftovers (less than a chunk) back to the start
+    if (d->inputPtr == d->inputBuf + d->inputBufSize) {
+        int leftover = (d->readPtr < d->inputPtr) ? d->inputPtr - d->readPtr : 0;
+        memmove(d->inputBuf, d->inputPtr - leftover, leftover);
+        d->readPtr  = d->inputBuf + (leftover ? 0 : d->readPtr - d->inputPtr);
+        d->inputPtr = d->inputBuf + leftover;
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+/* Signal detector. Takes chunks of raw rtl_sdr samples (interleaved unsigned char
+   I/Q), and finds the pulses in them. One Detector per stream of samples; detectors
+   share nothing but the FFT plan, so different detectors can run on different threads.
+
+   processingInit must be called once, before any detector is created. */
+
+typedef struct Detector Detector;
+
+// Called for each pulse found. Times are in usecs on the detector's timebase.
+// lastSample is the index (counting from the first sample the detector saw) of the
+// last sample in the pulse. snr is the best of the pulse's chunks, in dB above the 
+// rest of the spectrum.
+typedef void (*DetectorEmitFunc)(void *context, unsigned long startTime, unsigned long duration,
+                                 unsigned long long lastSample, float snr);
+
+// Hot path debug logging (see diaglog.h), and timebase chatter on stdout. Turned off
+// when we're shedding load, and when we're a library.
+extern bool debugOutput;
+
+// wisdomFile is FFTW wisdom to plan from, and to save the plan to if it has to be
+// made from scratch. NULL for none.
+bool processingInit(int fftSize, const char *wisdomFile);
+void processingShutDown();
+
+// Benchmark the ways of planning the FFT, and save the fastest to wisdomFile. Not
+// with detectors running - planning isn't thread safe. Returns usecs per FFT, or -1.
+double processingTune(int fftSize, const char *wisdomFile);
+
+Detector *detectorCreate(int rate, int stride, DetectorEmitFunc emit, void *emitContext);
+void detectorDestroy(Detector *d);
+
+// Process as many chunks as the input allows. Leftovers are kept for next time.
+void detectorFeed(Detector *d, const unsigned char *data, int len);
+
+// The same, for callers that can read straight into the detector's input buffer and
+// save the copy. detectorInputSpace says where the next input goes, and how much room
+// there is (never none, and whole samples if everything so far has been). 
+// detectorInputDone takes len bytes written there, with samplesLost missing
+// before them (see detectorSkip), and processes them.
+unsigned char *detectorInputSpace(Detector *d, int *len);
+void detectorInputDone(Detector *d, int len, unsigned long long samplesLost);
+
+// Tell the detector that nSamples are missing from the input, so that its clock
+// stays right across the gap.
+void detectorSkip(Detector *d, unsigned long long nSamples);
+
+// Process fftSize samples starting at charBuffer. For callers that manage their own
+// input; the caller moves 'stride' samples between chunks.
+void detectorProcessChunk(Detector *d, unsigned char *charBuffer);
+
+void detectorSetStride(Detector *d, int stride);
+void detectorSetSquelch(Detector *d, bool squelch);
+
+// The timebase resets after 5 seconds without a signal, by the wall clock. For offline
+// work, where the wall clock has nothing to do with the samples, count samples instead.
+void detectorSetSampleTimebase(Detector *d, bool sampleTimebase);
+unsigned long detectorSquelchedChunks(Detector *d);
+
+#endif // DETECTOR_H
@@ -0,0 +1,328 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "detector.h"
+#include "diaglog.h"
+
+typedef struct {
+    uint16_t event;
+    float peak;
+    float snr;
+    uint64_t time;
+    uint64_t a;
+    uint64_t b;
+} LogRecord;
+
+/* Bounded multi-producer ring (Vyukov's). Each slot's seq says whose turn it is: a
+   producer may fill slot i when seq == pos, and sets it to pos+1 when done; the writer
+   may read it when seq == pos+1, and hands it back for the next lap with pos+nSlots.
+   Producers claim a position with a compare-and-swap, so one that's preempted
+   mid-record only holds up the writer, not the other producers.
+
+   When the ring's empty the writer blocks on an eventfd. It sets sleeping first and
+   has one more look; a producer that finds sleeping set after filling its slot clears
+   it and kicks the eventfd. Fences on both sides mean at least one of them sees the
+   other, so a record can't be left sitting there - and producers only make the
+   syscall when the writer's actually asleep. */
+typedef struct {
+    size_t seq;
+    LogRecord record;
+} LogSlot;
+
+typedef struct {
+    LogSlot *slots;
+    size_t mask;
+    size_t enqueuePos __attribute__((aligned(64)));
+    size_t dequeuePos __attribute__((aligned(64)));     // writer only
+    unsigned long long dropped __attribute__((aligned(64)));
+    int level;
+    bool sleeping;
+    bool quit;
+    int wakeFd;
+    pthread_t writer;
+} LogRing;
+
+// Hot path events are chattier than state changes
+static const eLogLevel eventLevel[N_LOG_EVENTS] = {
+    LOG_INFO,   // LOG_MESSAGE_START
+    LOG_INFO,   // LOG_MESSAGE_END
+    LOG_INFO,   // LOG_SYNCH_LOST
+    LOG_INFO,   // LOG_SYNCH_COMMIT
+    LOG_INFO,   // LOG_SYNCH_SLIP
+    LOG_INFO,   // LOG_PACKET_ERROR
+    LOG_DEBUG,  // LOG_FOUND_SIGNAL
+    LOG_DEBUG,  // LOG_FIRST_SYNCH
+    LOG_DEBUG,  // LOG_SECOND_SYNCH
+    LOG_DEBUG,  // LOG_SYNC_SIGNAL
+    LOG_DEBUG,  // LOG_CHECK_SYNCHS
+    LOG_DEBUG,  // LOG_BAD_DISTANCE
+    LOG_DEBUG,  // LOG_UNEXPECTED_PULSE
+};
+
+static LogRing *ring = NULL;
+
+// Same words as the old fprintfs, so nobody's greps break
+static void writeRecord(const LogRecord *r)
+{
+    unsigned long time = (unsigned long)r->time;
+    unsigned long a = (unsigned long)r->a;
+    unsigned long b = (unsigned long)r->b;
+
+    switch (r->event) {
+    case LOG_MESSAGE_START:
+        fprintf(stderr, "Start of message - Found signal, time %lu, peak %f, snr %f\n", time, r->peak, r->snr);
+        break;
+    case LOG_MESSAGE_END:
+        fprintf(stderr, "END MESSAGE, time %lu\n", time);
+        break;
+    case LOG_SYNCH_LOST:
+        fprintf(stderr, "Synch lost, time %lu\n", time);
+        break;
+    case LOG_SYNCH_COMMIT:
+        fprintf(stderr, "SYNCH COMMIT %s, time %lu\n", a ? "space first" : "signal first", time);
+        break;
+    case LOG_SYNCH_SLIP:
+        fprintf(stderr, "GE synch slip, time %lu\n", time);
+        break;
+    case LOG_PACKET_ERROR:
+        fprintf(stderr, "GE packet error - %lu, %lu\n", a, b);
+        break;
+    case LOG_FOUND_SIGNAL:
+        fprintf(stderr, "Found signal, time %lu, peak %f, snr %f\n", time, r->peak, r->snr);
+        break;
+    case LOG_FIRST_SYNCH:
+        fprintf(stderr, "FIRST SYNCH %lu\n", time);
+        break;
+    case LOG_SECOND_SYNCH:
+        fprintf(stderr, "SECOND SYNCH %lu\n", time);
+        break;
+    case LOG_SYNC_SIGNAL:
+        fprintf(stderr, "Sync signal, time %lu, peak %f, snr %f\n", time, r->peak, r->snr);
+        break;
+    case LOG_CHECK_SYNCHS:
+        fprintf(stderr, "CHECK SYNCHS %lu\n", time);
+        break;
+    case LOG_BAD_DISTANCE:
+        fprintf(stderr, "Invalid distance %lu between packets\n", time);
+        break;
+    case LOG_UNEXPECTED_PULSE:
+        fprintf(stderr, "Unexpected signal %lu, %lu, in state %d, ignoring\n", time, a, (int)b);
+        break;
+    default:
+        break;
+    }
+}
+
+static bool takeRecord(LogRing *r, LogRecord *record)
+{
+    LogSlot *slot = &r->slots[r->dequeuePos & r->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != r->dequeuePos + 1) {
+        return false;
+    }
+    *record = slot->record;
+    __atomic_store_n(&slot->seq, r->dequeuePos + r->mask + 1, __ATOMIC_RELEASE);
+    r->dequeuePos++;
+    return true;
+}
+
+static bool recordReady(LogRing *r)
+{
+    return __atomic_load_n(&r->slots[r->dequeuePos & r->mask].seq, __ATOMIC_ACQUIRE) == r->dequeuePos + 1;
+}
+
+static void wakeWriter(LogRing *r)
+{
+    uint64_t one = 1;
+
+    if (write(r->wakeFd, &one, sizeof(one)) < 0) {
+        // counter's saturated, or we're being shut down. Either way it's awake.
+    }
+}
+
+static void waitForRecords(LogRing *r)
+{
+    uint64_t count;
+
+    __atomic_store_n(&r->sleeping, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!recordReady(r) && !__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE)) {
+        if (read(r->wakeFd, &count, sizeof(count)) < 0) {
+            // EINTR - go round again
+        }
+    }
+    __atomic_store_n(&r->sleeping, false, __ATOMIC_RELAXED);
+}
+
+static void *writerMain(void *arg)
+{
+    LogRing *r = (LogRing *)arg;
+    unsigned long long reportedDrops = 0;
+    LogRecord record;
+
+    for (;;) {
+        bool quit = __atomic_load_n(&r->quit, __ATOMIC_ACQUIRE);
+        bool wrote = false;
+
+        while (takeRecord(r, &record)) {
+            writeRecord(&record);
+            wrote = true;
+        }
+        unsigned long long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != reportedDrops) {
+            fprintf(stderr, "LOG ring full, dropped %llu records (%llu total)\n", dropped - reportedDrops, dropped);
+            reportedDrops = dropped;
+        }
+        // NB - quit was read before the last drain, so everything logged before quit
+        // was set has been written
+        if (quit) {
+            break;
+        }
+        if (!wrote) {
+            waitForRecords(r);
+        }
+    }
+    return NULL;
+}
+
+bool logStart(unsigned int nSlots, eLogLevel level)
+{
+    unsigned int size = 1;
+    LogRing *r;
+
+    if (ring) {
+        return true;
+    }
+    while (size < nSlots) {
+        size <<= 1;
+    }
+    r = (LogRing *)calloc(1, sizeof(LogRing));
+    if (!r || (r->slots = (LogSlot *)calloc(size, sizeof(LogSlot))) == NULL) {
+        fprintf(stderr, "Cannot allocate log ring\n");
+        free(r);
+        return false;
+    }
+    for (unsigned int i=0; i<size; i++) {
+        r->slots[i].seq = i;
+    }
+    r->mask = size - 1;
+    r->level = level;
+    if ((r->wakeFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Cannot create log writer eventfd, %s\n", strerror(errno));
+        free(r->slots);
+        free(r);
+        return false;
+    }
+    if (pthread_create(&r->writer, NULL, writerMain, r) != 0) {
+        fprintf(stderr, "Cannot start log writer\n");
+        close(r->wakeFd);
+        free(r->slots);
+        free(r);
+        return false;
+    }
+    __atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+    return true;
+}
+
+void logShutDown()
+{
+    LogRing *r = ring;
+
+    if (!r) {
+        return;
+    }
+    // Whoever's still logging has to be done by now - we're about to free the ring
+    __atomic_store_n(&ring, (LogRing *)NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->quit, true, __ATOMIC_RELEASE);
+    wakeWriter(r);
+    pthread_join(r->writer, NULL);
+    close(r->wakeFd);
+    free(r->slots);
+    free(r);
+}
+
+void logSetLevel(eLogLevel level)
+{
+    LogRing *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+
+    if (r) {
+        __atomic_store_n(&r->level, (int)level, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned long long logDropped()
+{
+    LogRing *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+
+    return r ? __atomic_load_n(&r->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+void logEvent(eLogEvent event, unsigned long time, float peak, float snr, unsigned long a, unsigned long b)
+{
+    LogRing *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+    eLogLevel level = eventLevel[event];
+    LogSlot *slot;
+    size_t pos;
+
+    if (!r || (int)level > __atomic_load_n(&r->level, __ATOMIC_RELAXED) ||
+        (level > LOG_WARN && !debugOutput)) {
+        return;
+    }
+
+    pos = __atomic_load_n(&r->enqueuePos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            // pos was updated for us. Try again.
+        } else if (diff < 0) {
+            // writer hasn't got to this one since last lap. Full.
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&r->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->record.event = (uint16_t)event;
+    slot->record.peak  = peak;
+    slot->record.snr   = snr;
+    slot->record.time  = time;
+    slot->record.a     = a;
+    slot->record.b     = b;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->sleeping, false, __ATOMIC_RELAXED)) {
+        wakeWriter(r);
+    }
+}
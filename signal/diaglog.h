@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIAGLOG_H
+#define DIAGLOG_H
+
+/* Diagnostic log. The detector and the packet decoder used to fprintf their chatter
+   straight to stderr, formatting floats on the DSP thread, several times a packet.
+   Now they drop a small binary record into a ring, and a background thread does the
+   formatting and the writing. Nothing on the hot path blocks: any number of threads
+   can log at once, and if the ring is full the record is dropped and counted.
+
+   Until logStart is called (and after logShutDown) logging does nothing. */
+
+typedef enum {
+    LOG_QUIET = 0,
+    LOG_WARN,           // something got thrown away
+    LOG_INFO,           // message and synch state changes
+    LOG_DEBUG           // every signal
+} eLogLevel;
+
+typedef enum {
+    // detector
+    LOG_MESSAGE_START,
+    LOG_MESSAGE_END,
+    LOG_SYNCH_LOST,
+    LOG_SYNCH_COMMIT,           // a: true if the second transmission is the signal
+    LOG_SYNCH_SLIP,
+    LOG_PACKET_ERROR,           // a: time between transmissions, b: second transmission's length
+    LOG_FOUND_SIGNAL,
+    LOG_FIRST_SYNCH,
+    LOG_SECOND_SYNCH,
+    LOG_SYNC_SIGNAL,
+    LOG_CHECK_SYNCHS,
+    // packet decoder
+    LOG_BAD_DISTANCE,           // time: gap between pulses
+    LOG_UNEXPECTED_PULSE,       // a: duration, b: decoder state
+    N_LOG_EVENTS
+} eLogEvent;
+
+// nSlots is rounded up to a power of two
+bool logStart(unsigned int nSlots, eLogLevel level);
+// Writes out whatever's left, and stops the writer
+void logShutDown();
+
+// Any time, from any thread
+void logSetLevel(eLogLevel level);
+
+// time is usecs on the detector's timebase; peak and snr as in detector.cpp (lastPeak,
+// lastSNR). Anything below LOG_WARN also needs debugOutput, so it goes quiet when
+// we're shedding load.
+void logEvent(eLogEvent event, unsigned long time, float peak, float snr, unsigned long a, unsigned long b);
+
+// Records lost to a full ring so far
+unsigned long long logDropped();
+
+#endif // DIAGLOG_H
@@ -0,0 +1,166 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "detector.h"
+#include "libdetector.h"
+
+#ifndef MIN
+#define MIN(a,b) (a<b?a:b)
+#endif
+
+#define FFT_SIZE            128         // same as signal_process
+#define INITIAL_PULSES      256
+#define MAX_FEED            (1 << 30)   // bytes per detectorFeed call
+
+struct DetectorSession {
+    Detector *detector;
+    DetectorPulse *pulses;      // waiting to be taken
+    long nPulses;
+    long maxPulses;
+    long firstPulse;            // next to be taken
+    bool outOfMemory;
+};
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static bool initOK = false;
+
+static void libraryInit()
+{
+    debugOutput = false;        // nobody wants our chatter
+    initOK = processingInit(FFT_SIZE, NULL);
+}
+
+static void emitSessionPulse(void *context, unsigned long startTime, unsigned long duration,
+                             unsigned long long lastSample, float snr)
+{
+    DetectorSession *session = (DetectorSession *)context;
+
+    if (session->nPulses == session->maxPulses) {
+        // make room. Shuffle down what's been taken first, if that's enough
+        if (session->firstPulse > session->maxPulses/2) {
+            memmove(session->pulses, session->pulses + session->firstPulse,
+                    (session->nPulses - session->firstPulse)*sizeof(DetectorPulse));
+            session->nPulses -= session->firstPulse;
+            session->firstPulse = 0;
+        } else {
+            long newMax = session->maxPulses*2;
+            DetectorPulse *newPulses = (DetectorPulse *)realloc(session->pulses, newMax*sizeof(DetectorPulse));
+            if (!newPulses) {
+                session->outOfMemory = true;
+                return;
+            }
+            session->pulses = newPulses;
+            session->maxPulses = newMax;
+        }
+    }
+    DetectorPulse *pulse = &session->pulses[session->nPulses++];
+    pulse->startTime = startTime;
+    pulse->endSample = lastSample;
+    pulse->duration  = (uint32_t)duration;
+    pulse->snr       = snr;
+}
+
+DetectorSession *detectorSessionCreate(int rate, int stride)
+{
+    DetectorSession *session;
+
+    pthread_once(&initOnce, libraryInit);
+    if (!initOK || rate <= 0 || stride <= 0) {
+        return NULL;
+    }
+    session = (DetectorSession *)calloc(1, sizeof(DetectorSession));
+    if (!session) {
+        return NULL;
+    }
+    session->maxPulses = INITIAL_PULSES;
+    session->pulses = (DetectorPulse *)malloc(session->maxPulses*sizeof(DetectorPulse));
+    session->detector = detectorCreate(rate, stride, emitSessionPulse, session);
+    if (!session->pulses || !session->detector) {
+        detectorSessionDestroy(session);
+        return NULL;
+    }
+    detectorSetSampleTimebase(session->detector, true);
+    return session;
+}
+
+void detectorSessionDestroy(DetectorSession *session)
+{
+    if (!session) {
+        return;
+    }
+    if (session->detector) {
+        detectorDestroy(session->detector);
+    }
+    free(session->pulses);
+    free(session);
+}
+
+long detectorSessionFeed(DetectorSession *session, const unsigned char *samples, size_t len)
+{
+    while (len > 0) {
+        int n = (int)MIN(len, (size_t)MAX_FEED);
+        detectorFeed(session->detector, samples, n);
+        samples += n;
+        len -= n;
+    }
+    if (session->outOfMemory) {
+        fprintf(stderr, "libdetector: out of memory, pulses were dropped\n");
+        session->outOfMemory = false;
+    }
+    return session->nPulses - session->firstPulse;
+}
+
+void detectorSessionSkip(DetectorSession *session, unsigned long long nSamples)
+{
+    detectorSkip(session->detector, nSamples);
+}
+
+long detectorSessionTake(DetectorSession *session, DetectorPulse *pulses, long maxPulses)
+{
+    long n = MIN(maxPulses, session->nPulses - session->firstPulse);
+
+    if (n <= 0) {
+        return 0;
+    }
+    memcpy(pulses, session->pulses + session->firstPulse, n*sizeof(DetectorPulse));
+    session->firstPulse += n;
+    if (session->firstPulse == session->nPulses) {
+        session->firstPulse = session->nPulses = 0;
+    }
+    return n;
+}
+
+BusReader *detectorBusAttach(const char *name)
+{
+    return busAttach(name);
+}
+
+void detectorBusDetach(BusReader *reader)
+{
+    busDetach(reader);
+}
+
+int detectorBusRead(BusReader *reader, BusRecord *record, uint64_t *lost)
+{
+    return busRead(reader, record, lost);
+}
@@ -0,0 +1,70 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBDETECTOR_H
+#define LIBDETECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pulsebus.h"
+
+/* libdetector.so - the detector, for other people's programs. decode/detector.py uses
+   it from Python. Plain C calls on plain memory: the caller's samples are read where
+   they are, and pulses are copied out into the caller's array.
+
+   Sessions are independent, so different threads can run different sessions at
+   once. One session must only be used by one thread at a time. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint64_t startTime;     // usecs, on the detector's timebase (see signal_process)
+    uint64_t endSample;     // last sample in the pulse, counting from the first one fed
+    uint32_t duration;      // usecs
+    float snr;              // dB above the rest of the spectrum, at its strongest
+} DetectorPulse;
+
+typedef struct DetectorSession DetectorSession;
+
+// rate in samples/sec, stride in samples between FFTs (signal_process uses 16)
+DetectorSession *detectorSessionCreate(int rate, int stride);
+void detectorSessionDestroy(DetectorSession *session);
+
+// Run the samples (interleaved unsigned char I/Q, as from rtl_sdr) through the detector.
+// Returns the number of pulses waiting to be taken, including any from earlier calls.
+long detectorSessionFeed(DetectorSession *session, const unsigned char *samples, size_t len);
+
+// nSamples are missing from the input. Keeps the timebase right across the gap.
+void detectorSessionSkip(DetectorSession *session, unsigned long long nSamples);
+
+// Copy up to maxPulses waiting pulses, oldest first. Returns the number copied.
+long detectorSessionTake(DetectorSession *session, DetectorPulse *pulses, long maxPulses);
+
+// The pulse bus reader (see pulsebus.h), for decode/pulsebus.py. Reading the bus safely
+// takes acquire loads, which Python can't do.
+BusReader *detectorBusAttach(const char *name);
+void detectorBusDetach(BusReader *reader);
+int detectorBusRead(BusReader *reader, BusRecord *record, uint64_t *lost);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBDETECTOR_H
@@ -22,7 +22,6 @@
 
 #include <unistd.h>
 #include <math.h>
-#include <fftw3.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -31,11 +30,29 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <float.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "detector.h"
+#include "daemon.h"
+#include "rtltcp.h"
+#include "packet.h"
+#include "dedup.h"
+#include "pulsebus.h"
+#include "diaglog.h"
 
 
 char *executableName;
 #define FFT_SIZE 128
 #define FFT_PER_CHUNK 1000
+#define INPUT_READ_SIZE (FFT_SIZE*2*8)   // bytes. Reads return early if there's less waiting
+#define NET_READ_SIZE   (1 << 16)        // bytes. Same, but the network delivers in big lumps
+#define BUS_SLOTS       4096             // records on the pulse bus. A couple of seconds of busy
+#define LOG_SLOTS       8192             // diagnostic log records waiting to be written
 
 #ifndef FALSE
 #define FALSE 0
@@ -60,713 +77,500 @@ void printUsage()
     fprintf(stderr, "times and durations\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "%s [-r <sampleRate, defaults to 1000000>] [file]\n", executableName);
+    fprintf(stderr, "%s [-r <sampleRate, defaults to 1000000>] [-F] [-l] [-t <traceFile>] [-f <freq>] [-g <gain>] [-b <bus>] [-v <level>] [-W <wisdom>] [file]\n", executableName);
     fprintf(stderr, "Will use stdin as input if file not specified\n");
+    fprintf(stderr, "file can also be tcp:<host>:<port>, to read from an rtl_tcp server. The dongle is\n");
+    fprintf(stderr, "set to the sample rate, and to -f <freq> in Hz and -g <gain> in tenths of a dB if given\n");
+    fprintf(stderr, "(automatic gain otherwise - -g 0 is a manual 0 dB). Dropped connections are retried forever\n");
+    fprintf(stderr, "When reading from a pipe or rtl_tcp, processing is degraded if we fall behind real time.\n");
+    fprintf(stderr, "-F disables this and always does full processing\n");
+    fprintf(stderr, "-l traces the latency from sample arrival to pulse and packet emission, and\n");
+    fprintf(stderr, "   reports a summary at exit or on SIGUSR1. -t also writes each event to traceFile\n");
+    fprintf(stderr, "-b also publishes pulses, and the packets decoded from them, to the shared memory\n");
+    fprintf(stderr, "   pulse bus /dev/shm/<bus>. See decode/pulsebus.py. A packet is published as soon\n");
+    fprintf(stderr, "   as it's decoded; its repeats once, with a count, after the sensor goes quiet.\n");
+    fprintf(stderr, "   pulsebus.py -k only prints the first - one event per burst. -B adds the counts\n");
+    fprintf(stderr, "-v sets how much diagnostic chatter goes to stderr: 0 none, 1 warnings, 2 message\n");
+    fprintf(stderr, "   and synch changes, 3 every signal (the default). SIGUSR2 steps through them\n");
+    fprintf(stderr, "-W plans the FFT from the FFTW wisdom in this file, which saves a few seconds at\n");
+    fprintf(stderr, "   startup on slow machines. If it's missing, it's made\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s --tune -W <wisdom> [-r <sampleRate>]\n", executableName);
+    fprintf(stderr, "Times the ways FFTW can plan the FFT on this machine, and saves the fastest to the\n");
+    fprintf(stderr, "wisdom file for -W to pick up\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s -d [-r <sampleRate>] [-w <workers>] [-f <freq>] [-g <gain>] [-b <bus>] [-v <level>] [-W <wisdom>] input...\n", executableName);
+    fprintf(stderr, "Daemon mode. Reads all inputs at once, on a pool of worker threads (one per core\n");
+    fprintf(stderr, "by default). Inputs are files, FIFOs, unix:<path> for a local sample socket, or\n");
+    fprintf(stderr, "tcp:<host>:<port> for an rtl_tcp server, tuned with -f and -g as above.\n");
+    fprintf(stderr, "Each pulse is tagged with the input's position in the list\n");
     fprintf(stderr, "\n");
 }
 
 
 
-// Convert complex unsigned char to normalized complex float
-static void convertToComplexFloat(unsigned char *src, float *dst, int nSamples)
-{
-    float *dstPtr = dst;
-    unsigned char  *srcPtr = src;
-    for (int i=0; i<nSamples; i++) {
-        const float k = 1.0f / 128.0f;
-        *dstPtr++ = (*srcPtr++ - 127.4f) * k;
-        *dstPtr++ = (*srcPtr++ - 127.4f) * k;
-    }
-}
 
-// debug
-float lastPeak;
-float lastSNR;
+// - Latency tracing. 
+//
+// For alarms, what matters is the time from the RF edge to the event coming out
+// the other end. When enabled, each input block is stamped with its (monotonic)
+// arrival time, and each emitted event records the delay from the arrival of the 
+// last sample that contributed to it. Latencies go into a histogram, and optionally
+// into a binary trace file, one LatencyRecord per event.
 
-// FFT. Used by Processing
+#define TRACE_MAGIC   0x544c5357    // "WSLT"
+#define TRACE_VERSION 1
 
-static fftwf_plan fftwfPlan = NULL;
-static float *window = NULL;
-static int fftSize = 128;
-static fftwf_complex *fft_dst = NULL;
-static fftwf_complex *fft_src  = NULL;
+typedef enum {
+    TRACE_PULSE = 1,
+    TRACE_PACKET = 2,           // decoded, on its way to the dedup table
+    N_TRACE_EVENTS
+} eTraceEvent;
+
+static const char *traceEventNames[N_TRACE_EVENTS] = {NULL, "pulse", "packet"};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t sampleRate;
+    uint32_t reserved;
+} LatencyTraceHeader;
+
+typedef struct {
+    uint64_t emitNsec;          // CLOCK_MONOTONIC at emission
+    uint32_t latencyNsec;       // saturates at ~4s
+    uint32_t startTime;         // event start, usecs on the current timebase
+    uint32_t duration;          // usecs
+    uint32_t event;             // eTraceEvent
+} LatencyRecord;
+
+// Log-linear histogram of latencies in usecs. Exact below 16, then 16 sub-buckets 
+// per power of two, so percentiles are good to about 6%.
+#define LATENCY_SUB_BITS   4
+#define LATENCY_SUB        (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS    (LATENCY_SUB + (40 - LATENCY_SUB_BITS)*LATENCY_SUB)
+
+#define ARRIVAL_RING_SIZE 64        // must be a power of two
+
+typedef struct {
+    unsigned long long endSample;   // one past the last sample in the block
+    unsigned long long nsec;
+} ArrivalStamp;
+
+static bool bLatencyTracing = false;
+static FILE *latencyTraceFile = NULL;
+static ArrivalStamp arrivals[ARRIVAL_RING_SIZE];
+static unsigned int arrivalHead = 0;    // next slot to write
+static unsigned int arrivalCount = 0;
+static unsigned long latencyHistogram[N_TRACE_EVENTS][LATENCY_BUCKETS];
+static unsigned long latencyCount[N_TRACE_EVENTS];
+static unsigned long long latencyMax[N_TRACE_EVENTS];
+static unsigned long latencyUnmatched = 0;
+
+static unsigned long long monotonicNsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
 
-// XXX  ?? what does this do, anyway? There's a normalization across the buffer.
-static void initWindow() 
+static int latencyBucket(unsigned long long usecs)
 {
-    static const double Tau = M_PI * 2.0;
-    window = (float *)malloc(fftSize * sizeof(float)); 
-    for (int i = 0; i < fftSize; i++) {
-        window[i] = 0.5f * (1.0f - cos(Tau * i / (fftSize - 1)));
+    if (usecs < LATENCY_SUB) {
+        return (int)usecs;
     }
+    int msb = 63 - __builtin_clzll(usecs);
+    int bucket = LATENCY_SUB + (msb - LATENCY_SUB_BITS)*LATENCY_SUB + 
+                 (int)((usecs >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+    return MIN(bucket, LATENCY_BUCKETS - 1);
 }
 
-void initFFT(int fft_Size)
+// Largest latency that lands in the bucket
+static unsigned long long latencyBucketLimit(int bucket)
 {
-    fftSize = fft_Size;
-    fft_src = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
-    fft_dst = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
-
-    fftwfPlan = fftwf_plan_dft_1d(fftSize, 
-                                fft_src, 
-                                fft_dst, 
-                                FFTW_FORWARD, 
-                                FFTW_MEASURE);
-                           
-    initWindow();
+    if (bucket < LATENCY_SUB) {
+        return bucket;
+    }
+    int msb = (bucket - LATENCY_SUB)/LATENCY_SUB + LATENCY_SUB_BITS;
+    unsigned long long sub = (bucket - LATENCY_SUB) % LATENCY_SUB;
+    return ((LATENCY_SUB + sub + 1) << (msb - LATENCY_SUB_BITS)) - 1;
 }
 
-void destroyFFT() 
+bool latencyInit(const char *traceFileName, int rate)
 {
-    if (fftwfPlan) {
-        fftwf_destroy_plan(fftwfPlan);
-        fftwfPlan = NULL; 
+    bLatencyTracing = true;
+    if (traceFileName) {
+        LatencyTraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(LatencyRecord), (uint32_t)rate, 0};
+        latencyTraceFile = fopen(traceFileName, "wb");
+        if (!latencyTraceFile) {
+            fprintf(stderr, "Cannot open trace file %s, %s\n", traceFileName, strerror(errno));
+            return false;
+        }
+        fwrite(&header, sizeof(header), 1, latencyTraceFile);
     }
-    if (window != NULL) { 
-        free(window);
-        window = NULL;
-    } 
+    return true;
 }
 
-void getFFT(float *src, float *dst) 
-{                               
-    for (int i = 0; i < fftSize; i++) {
-        src[i*2]     *= window[i];
-        src[i*2 + 1] *= window[i];
+// Stamp a block of input. endSample counts every sample ever read.
+void latencyInputArrived(unsigned long long endSample)
+{
+    if (!bLatencyTracing) {
+        return;
     }
-    memcpy(fft_src, src, fftSize*sizeof(fftwf_complex));
-    fftwf_execute(fftwfPlan);
+    arrivals[arrivalHead].endSample = endSample;
+    arrivals[arrivalHead].nsec = monotonicNsecs();
+    arrivalHead = (arrivalHead + 1) & (ARRIVAL_RING_SIZE - 1);
+    if (arrivalCount < ARRIVAL_RING_SIZE) {
+        arrivalCount++;
+    }
+}
+
+// Record an event whose last contributing sample is lastSample
+static void latencyEmitted(eTraceEvent event, unsigned long long lastSample, unsigned long startTime, unsigned long duration)
+{
+    unsigned long long emitNsec, arrivalNsec = 0;
+    bool found = false;
+    
+    if (!bLatencyTracing) {
+        return;
+    }
+    emitNsec = monotonicNsecs();
     
-    const float invFFTSize = 1.0f / fftSize;
-    const float logMultiplier = 10.0f / log2f(10.0f);
-    int k = fftSize/2; // start from the middle of the FFTW array and wrap, putting signal in the center
-    float *dstPtr = dst;
-
-    for (int i = 0; i < fftSize; i++) {
-        float real = fft_dst[k][0]*invFFTSize;
-        float imag = fft_dst[k][1]*invFFTSize;
-        float power = real*real + imag*imag;
-        float logPower = log2f(power) * logMultiplier;
-        *dstPtr++ = logPower;
-        k++;
-        if (k >= fftSize) {
-            k = 0;
+    // oldest block that contains the sample
+    for (unsigned int i=0; i<arrivalCount; i++) {
+        ArrivalStamp *stamp = &arrivals[(arrivalHead - arrivalCount + i) & (ARRIVAL_RING_SIZE - 1)];
+        if (stamp->endSample > lastSample) {
+            arrivalNsec = stamp->nsec;
+            found = true;
+            break;
         }
     }
+    if (!found) {
+        latencyUnmatched++;
+        return;
+    }
+    
+    unsigned long long latencyNsec = emitNsec - arrivalNsec;
+    unsigned long long latencyUsec = latencyNsec/1000;
+    latencyHistogram[event][latencyBucket(latencyUsec)]++;
+    latencyCount[event]++;
+    latencyMax[event] = MAX(latencyMax[event], latencyUsec);
+    
+    if (latencyTraceFile) {
+        LatencyRecord record;
+        record.emitNsec    = emitNsec;
+        record.latencyNsec = (uint32_t)MIN(latencyNsec, (unsigned long long)UINT32_MAX);
+        record.startTime   = (uint32_t)startTime;
+        record.duration    = (uint32_t)duration;
+        record.event       = event;
+        fwrite(&record, sizeof(record), 1, latencyTraceFile);
+    }
 }
 
-
-// - Processing. 
-
-static int chunkSize = 0;  // Size of chunk, in samples.
-static float *dstBuffer = NULL;
-static float *sampleBuffer = NULL;
-static unsigned long timebase = 0;
-static bool bProcessingInit = false;
-static unsigned long sampleRate = 1000000;
-static unsigned int processingStride;
-static unsigned int nChunksRead = 0;
-static unsigned long signalStartTime = 0;
-static unsigned long bytesProcessed = 0;
-
-//static bool signalDetected = false;
-
-float *firstSynchBuffer     = NULL;
-float *secondSynchBuffer    = NULL;
-
-#define THRESHOLD -15.0f
-#define NOISE_THRESHOLD -50.0f
-
-typedef enum {
-    FIRST_SYNCH,
-    TRANSITION_TO_SECOND_SYNCH,
-    SECOND_SYNCH,
-    TRANSITION_OUT_OF_SYNCH
-} eSynchState;
-
-typedef enum {
-    NO_MESSAGE,
-    SYNCHING,
-    IN_MESSAGE
-} eProcessingState;
-
-typedef enum {
-    MSG_SIGNAL,
-    MSG_NO_SIGNAL,
-    MSG_TRANSITION = 3,
-    MSG_UNKNOWN = 4
-} eSignalState;
-
-eSynchState synchState;
-eProcessingState processingState;
-eSignalState msgState;
-
-#define SYNCH_SETTLE_TIME 30
-
-unsigned long firstSynchStartTime  = 0;
-unsigned long secondSynchStartTime = 0;
-
-
-static void resetProcessingState(void);
-static bool findTransmission(float *buffer, int bufferLen, int *peak, float *s2nr);
-
-void processingInit(int fftSize, int rate, int stride)
+static unsigned long long latencyPercentile(eTraceEvent event, int percent)
 {
-    if (!bProcessingInit) {
-        initFFT(fftSize);
-        chunkSize = fftSize;
-        sampleBuffer = (float *)malloc(chunkSize * 2 * sizeof(float));
-        dstBuffer    = (float *)malloc(chunkSize * sizeof(float));
-        firstSynchBuffer  = (float *)malloc(chunkSize * sizeof(float));
-        secondSynchBuffer = (float *)malloc(chunkSize * sizeof(float));
-        timebase = 0;
-        sampleRate = rate;
-        processingStride = stride;
-        resetProcessingState();
-    }
-    bProcessingInit = true;
+    unsigned long target = (latencyCount[event]*percent + 99)/100;
+    unsigned long acc = 0;
+    
+    for (int i=0; i<LATENCY_BUCKETS; i++) {
+        acc += latencyHistogram[event][i];
+        if (acc >= target && acc > 0) {
+            return MIN(latencyBucketLimit(i), latencyMax[event]);
+        }
+    }
+    return latencyMax[event];
 }
 
-void processingShutDown()
+void latencyReport()
 {
-    if (!bProcessingInit) {
-        destroyFFT();
-        if (sampleBuffer) {
-            free(sampleBuffer);
-            sampleBuffer = NULL;
-        }
-        if (dstBuffer) {
-            free(dstBuffer);
-            dstBuffer = NULL;
-        }
-        
-        if (firstSynchBuffer) {
-            free(firstSynchBuffer);
-            firstSynchBuffer = NULL;
-        }
-        
-        if (secondSynchBuffer) {
-            free(secondSynchBuffer);
-            secondSynchBuffer = NULL;
+    if (!bLatencyTracing) {
+        return;
+    }
+    for (int i=TRACE_PULSE; i<N_TRACE_EVENTS; i++) {
+        eTraceEvent event = (eTraceEvent)i;
+        if (event == TRACE_PULSE || latencyCount[event] > 0) {
+            fprintf(stderr, "LATENCY %s events %lu, p50 %llu usec, p99 %llu usec, max %llu usec\n", traceEventNames[event],
+                    latencyCount[event], latencyPercentile(event, 50), latencyPercentile(event, 99), latencyMax[event]);
         }
     }
-    bProcessingInit = false;
+    if (latencyUnmatched) {
+        fprintf(stderr, "LATENCY unmatched %lu\n", latencyUnmatched);
+    }
+    if (latencyTraceFile) {
+        fflush(latencyTraceFile);
+    }
 }
 
-
-static void emitSignal(int startTime, int duration)
+void latencyShutDown()
 {
-    fprintf(stdout, "[%d, %d]\n", startTime, duration);
-    fflush(stdout); // yeah, the \n should flush it. Don't know wtf is happening
+    if (latencyTraceFile) {
+        fclose(latencyTraceFile);
+        latencyTraceFile = NULL;
+    }
+    bLatencyTracing = false;
 }
 
-float s2nrThreshold = 0.50f;  // XXX nfc what this should be. Check empirically
 
-// XXX - I could find the transmission frequency empirically, just by looking at what it
-// is over time. Later.
 
-static bool transmissionPresent(float *buffer, int bufferLen)
-{
-    // Go through buffer, looking for a signal that rises
-    // above the average power
-    int peak;
-    float s2nr;
-    if( findTransmission(buffer, bufferLen, &peak, &s2nr) ){
-        //fprintf(stderr, "Peak at %d\n", peak); // XXX DEBUG only
-        return (s2nr < s2nrThreshold); // since power is negative, the snr threshold points this way
-    } else {
-        return false;
-    }
-}
+// - Load shedding. 
+//
+// When reading live samples from a pipe (rtl_sdr | signal_process), falling behind
+// means the pipe fills up, rtl_sdr drops USB samples on the floor, and our timestamps
+// drift without anybody noticing. Same for rtl_tcp, with the socket buffer standing in
+// for the pipe. So we watch how full the pipe is, and how far the
+// sample clock has fallen behind the wall clock, and step down to cheaper processing
+// when we get behind. We step back up once we've caught up.
 
-/*
-With this version, I'm just comparing total power. This is not very useful for comparing
-different spectra with similar power, or for comparing random noise with random noise 
-*/
-/*
-static float signalDifferential(float *buffer1, float *buffer2, int bufferLen) 
+typedef enum {
+    LOAD_FULL,          // normal stride, debug output
+    LOAD_WIDE_HOP,      // double the stride, no debug output
+    LOAD_SQUELCH,       // wide hop, and skip the FFT for quiet chunks between messages
+    N_LOAD_LEVELS
+} eLoadLevel;
+
+static const char *loadLevelNames[N_LOAD_LEVELS] = {"full", "wide hop", "squelch"};
+
+#define LOAD_CHECK_INTERVAL   50000     // usecs between checks
+#define LOAD_HIGH_WATER       50        // percent pipe fill at which we step down
+#define LOAD_OVERRUN_WATER    90        // percent pipe fill at which upstream is probably dropping
+#define LOAD_LOW_WATER        10        // percent pipe fill below which we're keeping up
+#define LOAD_CALM_CHECKS      20        // consecutive checks under low water before stepping up
+#define LOAD_DRIFT_TOLERANCE  100000    // usecs the sample clock may trail the wall clock
+#define LOAD_NOT_LIVE_LEAD    1000000   // usecs ahead of the wall clock that means 'not live'
+
+typedef struct {
+    bool enabled;
+    eLoadLevel level;
+    int fd;
+    int pipeSize;                       // or socket receive buffer size
+    Detector *detector;
+    int baseStride;
+    unsigned long rate;
+    struct timespec anchorTime;         // wall clock when the sample clock was last synced
+    unsigned long long anchorBytes;     // bytes produced upstream as of the anchor
+    unsigned long long bytesRead;       // bytes, not samples - reads needn't be whole samples
+    unsigned long long lastCheck;       // usecs since anchor
+    int calmChecks;
+    bool overrunning;
+    // counters
+    unsigned int nOverruns;             // pipe (nearly) full - upstream is dropping samples
+    unsigned int nDrifts;               // sample clock fell behind - samples lost upstream
+    unsigned long long driftUsecs;      // total time lost to drift
+    unsigned int nDegrades;
+    unsigned int nRecoveries;
+} LoadMonitor;
+
+static unsigned long long usecsSince(struct timespec *then)
 {
-    //float diffBuf[bufferLen]; 
-    //float *diffBufPtr = diffBuf;
-    float *buffer1Ptr = buffer1;
-    float *buffer2Ptr = buffer2;
-    float cumDif = 0;
-    
-    for (int i=0; i<bufferLen; i++) {
-        float diff = *buffer1Ptr++ - *buffer2Ptr++;  // intentionally signed. random errors should cancel.
-   //     *diffBufPtr++ = diff;
-        cumDif += diff;
-    }
-    // For the moment, I'll just use the cumulative differential
-    printf("Signal Differential is %f\n", cumDif/bufferLen);
-    return cumDif/bufferLen;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec)*1000000ULL + (now.tv_nsec - then->tv_nsec)/1000;
 }
-*/
 
-
-// Slightly different version - compare snr for the two buffers
-static float signalDifferential(float *buffer1, float *buffer2, int bufferLen) 
+static int loadStride(LoadMonitor *mon)
 {
-    int peak1, peak2;
-    float snr1, snr2;
-    bool hasTransmission1, hasTransmission2;
-    float retVal = 1.0f;
-    
-    hasTransmission1 = findTransmission(buffer1, bufferLen, &peak1, &snr1);
-    hasTransmission2 = findTransmission(buffer2, bufferLen, &peak2, &snr2);
-        
-    // signal differential is snr/snr, for with smaller snr as numerator, larger
-    // as denominator, if we have transmissions for both
-    if (hasTransmission1 && hasTransmission2) {
-        float snrMax = MAX(snr1,snr2);
-        float snrMin = MIN(snr1,snr2);
-        retVal = snrMin/snrMax;
-    // If there is only a transmission for one of them, return 0.1
-    } else if (hasTransmission1 || hasTransmission2) {
-        retVal = 0.1;
-    // If there is a transmission for neither, return 1.0
-    } else {
-       retVal = 1.0;
-    } 
-    
-//    printf("Signature differential is %f\n", retVal);
-    return retVal;
+    return (mon->level >= LOAD_WIDE_HOP) ? mon->baseStride*2 : mon->baseStride;
 }
 
-
-
-//bool bInTransmission = false;
-
-unsigned long lastTransmissionTime = 0;
-
-float *signalSignature      = NULL;
-float *spaceSignature       = NULL;
-
-#define INITIAL_SPACE_MIN 30000
-#define INITIAL_SPACE_MAX 60000
-#define INITIAL_SIGNAL_MIN 800
-#define INITIAL_SIGNAL_MAX 1200
-
-//#define ID_THRESHOLD 35.f // XXX I have no idea how big this should be
-#define ID_THRESHOLD 0.8f // XXX I have no idea how big this should be
-
-#define END_MSG_TIMEOUT 1000 // 1 millisecond without a signal is considered to be the end of a transmission
-
-static int identifyBuffer(float *buffer, int bufferLen)
+static void loadReport(LoadMonitor *mon, const char *event)
 {
-    if (bufferLen != fftSize) {
-        fprintf(stderr, "Unexpected buffer size!\n");
-        return MSG_UNKNOWN;
-    }
-    // Attempt to figure out what this buffer represents - signal, space between signals, 
-    // or a transitional state. Note that I'm changing the order in which I do the comparisons
-    // depending on the current state, since the buffer will almost always be the same
-    // type as the previous one.
-    if (msgState == MSG_SIGNAL) {
-        if (signalSignature && signalDifferential(buffer, signalSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_SIGNAL;
-//} else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
-//            return MSG_TRANSITION;
-        } else if (spaceSignature && signalDifferential(buffer, spaceSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_NO_SIGNAL;
-        } else {
-            return MSG_UNKNOWN;
-        }
-    } else if (msgState == MSG_NO_SIGNAL) {
-        if (spaceSignature && signalDifferential(buffer, spaceSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_NO_SIGNAL;
-//        } else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
-//            return MSG_TRANSITION;
-        } else if (signalSignature && signalDifferential(buffer, signalSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_SIGNAL;
-        } else {
-            return MSG_UNKNOWN;
-        }
-    } else if (msgState == MSG_TRANSITION || msgState == MSG_UNKNOWN) {
-        if (signalSignature && signalDifferential(buffer, signalSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_SIGNAL;
-//        } else if (transitionSignature && signalDifferential(buffer, transitionSignature, bufferLen) > ID_THRESHOLD) {
-//            return MSG_TRANSITION;
-        } else if (spaceSignature && signalDifferential(buffer, spaceSignature, bufferLen) > ID_THRESHOLD) {
-            return MSG_NO_SIGNAL;
-        } else {
-            return MSG_UNKNOWN;
-        }
-    }
-    
-    return MSG_UNKNOWN;
+    fprintf(stderr, "LOAD %s, level %s - overruns %u, drifts %u (%llu usec), degrades %u, recoveries %u, squelched %lu\n",
+            event, loadLevelNames[mon->level], mon->nOverruns, mon->nDrifts, mon->driftUsecs, 
+            mon->nDegrades, mon->nRecoveries, detectorSquelchedChunks(mon->detector));
 }
 
-/* processBuffer -
-   Take an incoming buffer with data in the frequency domain, and call emitSignal if 
-   needed. In order to emit a signal, we must know both the start of the signal and the 
-   duration of the signal, so we need to track state transitions between signalling and 
-   non-signalling.
-   
-   The process of tracking transitions is somewhat complicated because empirically, the 
-   spectrum received appears to have four distinct states*, and not all of them 
-   necessarily appear in each data packet.
-   
-   To add to the complexity, although the signatures of these states are consistent 
-   across a single data packet transmission, they can vary wildly depending on the 
-   particular transmitter, radio, and distance between the two. The same equipment in the 
-   same geometric configuration can even show differences in received transmission 
-   signatures for packets sent a few seconds apart. 
-   
-   To deal with all of this, I introduce a fairly complex state machine and incorporate
-   some logic specific to the GE Wireless sensors.**  In particular, a few milliseconds 
-   before the beginning of the data bits, the radio puts out a signature equivalent to the
-   'space' between actual signals. (Depending on the distance between the radio and the 
-   transmitter, however, this transmission may or may not be distinguishable from the 
-   background noise.) After this signature there is always an approximately 1ms 
-   transmission in the 'signalled' state. Therefor, in order to figure out what is signal 
-   and what is space, I look at the first two transmissions in the packet. Whichever 
-   transmission is about 1ms long is signal, the other is space.
-   
-   * Signalled, non-signalled, transitional, and background. There's always a visible
-   frequency spike in the signalled state. Non-signalled and transitional states may
-   look like background noise.
-   
-   ** I'm sad about having to bring this high-level knowledge of the protocol down into
-     this low-level routine. The core problem is that I can't know whether the start of
-     the transmission represents signal or space. Perhaps there's a better way than 
-     matching the initial data to what I expect to see from the GE Sensors - maybe, for
-     instance, the transmission is always significantly stronger during a signal than 
-     during a space.   
-*/
-
-
-static void resetProcessingState()
+static void loadSetLevel(LoadMonitor *mon, eLoadLevel level)
 {
-    synchState = FIRST_SYNCH;
-    processingState = NO_MESSAGE;
-    msgState = MSG_NO_SIGNAL;
+    mon->level = level;
+    debugOutput = (level == LOAD_FULL);
+    detectorSetSquelch(mon->detector, level >= LOAD_SQUELCH);
 }
 
-/* GE_DifferentiateSignalFromSpace
-   GE-specific code here. At this point we should have the first two 
-   transitions in a packet, and we should be able to figure out which
-   is signal and which is space. In this routine, we do this by looking
-   at the transmission lengths, which are specific to GE Wireless sensors
-   
-   Note that we could create other similar functions for other sensors,
-   or we could replace this function with something more general */
-static bool GE_DifferentiateSignalFromSpace(int firstSynchDuration, int secondSynchDuration)
+static void loadInit(LoadMonitor *mon, Detector *detector, int fd, int stride, unsigned long rate, bool allowShedding)
 {
-    bool startBeforeSignal;
+    struct stat st;
     
-    //printf("Diff signal from space, firstDuration %d, secondDuration %d\n", firstSynchDuration, secondSynchDuration);
+    memset(mon, 0, sizeof(*mon));
+    mon->detector = detector;
+    mon->fd = fd;
+    mon->baseStride = stride;
+    mon->rate = rate;
     
-    // does the second buffer look more like the longish signal blip,
-    // or more like the short no-signal blip that follows the longish
-    // signal blip?
-    if (secondSynchDuration <= INITIAL_SIGNAL_MAX && 
-        secondSynchDuration >= INITIAL_SIGNAL_MIN) {
-        startBeforeSignal = true;
-    } else if (firstSynchDuration <= INITIAL_SIGNAL_MAX && 
-               firstSynchDuration >= INITIAL_SIGNAL_MIN) {
-        startBeforeSignal = false;
-    } else {
-        fprintf(stderr, "GE packet error - %d, %d\n", firstSynchDuration, secondSynchDuration);
-        return false; // doesn't look like a GE Wireless packet
+    // Only live input can get ahead of us. Files can wait.
+    if (allowShedding && fstat(fd, &st) == 0) {
+        if (S_ISFIFO(st.st_mode)) {
+            mon->pipeSize = fcntl(fd, F_GETPIPE_SZ);
+        } else if (S_ISSOCK(st.st_mode)) {
+            socklen_t len = sizeof(mon->pipeSize);
+            if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &mon->pipeSize, &len) < 0) {
+                mon->pipeSize = 0;
+            }
+        }
+        mon->enabled = (mon->pipeSize > 0);
     }
-    
-    if (startBeforeSignal) {
-        spaceSignature  = firstSynchBuffer;
-        signalSignature = secondSynchBuffer;        
-    } else {
-        spaceSignature  = secondSynchBuffer;
-        signalSignature = firstSynchBuffer; 
-    }  
-    
-    return true;     
+    loadSetLevel(mon, LOAD_FULL);
 }
 
-unsigned long prevStartTime = 0;
-unsigned long prevTime = 0;
+// Sync the sample clock to the wall clock. Samples still in the pipe were produced
+// before now, so they count against the anchor.
+static void loadAnchor(LoadMonitor *mon, int pending)
+{
+    clock_gettime(CLOCK_MONOTONIC, &mon->anchorTime);
+    mon->anchorBytes = mon->bytesRead + pending;
+    mon->lastCheck = 0;
+}
 
-static void processBuffer(float *buffer, int bufferLen)
+// The input was reconnected. Nothing upstream of the new connection has anything to
+// do with the old one, so start the clocks again.
+static void loadReconnected(LoadMonitor *mon, int fd)
 {
-    bool transmitting = transmissionPresent(buffer, bufferLen);
-    int signalType; 
-    unsigned long curTime;
- 
-    bytesProcessed += processingStride; 
-    curTime = bytesProcessed/(((float)sampleRate)/1000000);
-    if (curTime < prevTime) printf("WRAP\n");
-    prevTime = curTime;   
- 
-    // make note of the last time we saw a transmission. This is used to change the 
-    // state at the end of a message
-    if (transmitting) {
-        lastTransmissionTime = curTime;
-    }
-    
-//    fprintf(stderr, "Processing state is %d,transmitting %d, synchState %d, curtime %d\n", processingState, transmitting, synchState, curTime);
-    
-    switch (processingState) {
-    case NO_MESSAGE:
-        if (!transmitting) {
-            // reset timebase if it's been more than 5 seconds since the previous signal
-            if (time(0) - timebase > 5) {
-                timebase = time(0);
-                printf("TIMEBASE RESET, time is %lu\n", timebase);
-                bytesProcessed = 0;
-            }
-        } else {
-            //fprintf(stderr, "Detected message, %lu\n", curTime);
-            // Beginning of a message. Start the synching process.
-            firstSynchStartTime = curTime;
-            processingState = SYNCHING;
-            synchState = FIRST_SYNCH;
-            if (curTime < prevStartTime) printf("CSW WRAP!\n");
-            prevStartTime = curTime;
-            fprintf(stderr, "Start of message - Found signal, time %lu, peak %f, snr %f\n", curTime, lastPeak, lastSNR);
-        }
-        break;
-    case IN_MESSAGE:
-        // is this space or signal? 
-        if (!transmitting) {
-            signalType = MSG_NO_SIGNAL;
-            //fprintf(stderr, "no signal\n");
-        } else {
-            signalType = identifyBuffer(buffer, bufferLen);
-            //fprintf(stderr, "Signal type is %d\n", signalType);
-        } 
-        
-        //fprintf(stderr, "Diff time is %lu\n", curTime - lastTransmissionTime);
-        //fprintf(stderr, "cur time %lu, last trans time %lu\n", curTime, lastTransmissionTime);
-        
-        // quick check - has the message ended? If so, change state and immediately break
-        if ((signalType == MSG_NO_SIGNAL || signalType == MSG_UNKNOWN) && 
-            (curTime - lastTransmissionTime > END_MSG_TIMEOUT)) {
-            fprintf(stderr, "END MESSAGE, time %lu\n", curTime);
-            resetProcessingState(); 
-            break;
-        } 
-        
-        
-        // normal flow - emit signal on state change, otherwise nop
-        switch (msgState){
-        case MSG_SIGNAL:
-            if (signalType == MSG_NO_SIGNAL) {
-                // state changes. Emit current signal.
-                msgState = MSG_NO_SIGNAL;
-                emitSignal(signalStartTime, curTime - signalStartTime);
-            } else {
-                // nop. Treat 'unknown' and 'transition' as part of the signal.
-            }
-            break;
-        case MSG_NO_SIGNAL:
-            if (signalType == MSG_SIGNAL) {
-                fprintf(stderr, "Found signal, time %lu, peak %f, snr %f\n", curTime, lastPeak, lastSNR);
-                // state changes. Set signal start time
-                msgState = MSG_SIGNAL;
-                signalStartTime = curTime;
-            } else {
-                // nop. Treat 'unknown' and 'transition' as part of the space
-            } 
-            break;
-        default:
-            break;
-        }
-        break;
-    case SYNCHING:
-        switch (synchState) {
-        case FIRST_SYNCH:
-            if (curTime - firstSynchStartTime >= SYNCH_SETTLE_TIME) {
-                if (transmitting) {
-                    memcpy(firstSynchBuffer, buffer, bufferLen*sizeof(float));
-                    synchState = TRANSITION_TO_SECOND_SYNCH;    
-                    fprintf(stderr, "FIRST SYNCH %lu\n",curTime);                
-                    fprintf(stderr, "Sync signal, time %lu, peak %f, snr %f\n", curTime, lastPeak, lastSNR);
-                } else {
-                    //fprintf(stderr, "signal inconsistency in first sync\n"); // XXX - it may be better to just ignore this, or have it be only a special debug printf.
-                }
-            } else {
-                // nop. Settling after transition to first sync.
-            }
-            break;
-        case TRANSITION_TO_SECOND_SYNCH:
-            if (!transmitting || 
-                signalDifferential(firstSynchBuffer, buffer, bufferLen) < ID_THRESHOLD) { // XXX may want the threshold bigger here?
-                    synchState = SECOND_SYNCH;
-                    fprintf(stderr, "SECOND SYNCH %lu\n", curTime);
-                    secondSynchStartTime = curTime;
-            } else {
-                // nop. Haven't found the transition point yet.
-            }
-            break;
-        case SECOND_SYNCH:
-            if (curTime - secondSynchStartTime >= SYNCH_SETTLE_TIME) {
-                memcpy(secondSynchBuffer, buffer, bufferLen*sizeof(float));
-                synchState = TRANSITION_OUT_OF_SYNCH;
-                fprintf(stderr, "Sync signal, time %lu, peak %f, snr %f\n", curTime, lastPeak, lastSNR);
-            } else {
-                // nop. Settling after transition to second sync
-            }
-            break;
-        case TRANSITION_OUT_OF_SYNCH:
-            if (signalDifferential(secondSynchBuffer, buffer, bufferLen) < ID_THRESHOLD) { // XXX may want the threshold bigger here?
-                fprintf(stderr, "CHECK SYNCHS %lu\n", curTime);
-                if (GE_DifferentiateSignalFromSpace(secondSynchStartTime - firstSynchStartTime, 
-                                                     curTime - secondSynchStartTime)){
-                    if (firstSynchBuffer == spaceSignature) {
-                        emitSignal(secondSynchStartTime, curTime - secondSynchStartTime);
-                        msgState = MSG_NO_SIGNAL;
-                    } else {
-                        emitSignal(firstSynchStartTime, secondSynchStartTime - firstSynchStartTime);
-                        msgState = MSG_SIGNAL;
-                        signalStartTime = curTime;
-                    } 
-                    processingState = IN_MESSAGE;
-                } else {
-                    fprintf(stderr, "Not GE packet. Ignoring\n");
-                    resetProcessingState();
-                }
-            } else {
-                // nop. Haven't found the transition point yet.
-            }
-            break;
-        default:
-            break;
-        }
-        break;
-    default:
-        break;
+    mon->fd = fd;
+    mon->overrunning = false;
+    if (mon->enabled) {
+        loadAnchor(mon, 0);
     }
 }
 
-#define SLIDING_WINDOW_SIZE 2  // XXX check experimentally
-static bool findTransmission(float *buffer, int bufferLen, int *peak, float *s2nr)
+// Called after every read. Cheap unless it's time for a check.
+static void loadCheck(LoadMonitor *mon, int nBytesRead)
 {
-    //float slidingWindow[SLIDING_WINDOW_SIZE]; // XXX this is a better optimization... Do I need it?
-    float *bufferPtr = buffer;
-    float maxWindowPower = -FLT_MAX;   // maximum power in any particular window
-    float accPower = 0;   // total power in the spectrum
-    int transmissionFreqStart = 0;
+    int pending = 0;
+    unsigned long long wallUsecs, producedUsecs;
+    int fill;
     
-    if (bufferLen <= SLIDING_WINDOW_SIZE){
-        return false;
+    if (!mon->enabled) {
+        return;
     }
-    
-    // go through all the sliding windows, looking for the one that has the highest
-    // total power. Also sum the power in the buffer
-    for (int j=0; j<bufferLen-SLIDING_WINDOW_SIZE; j++){
-        bufferPtr = &buffer[j];
-        accPower += *bufferPtr;
-        
-        float windowPower = 0; 
-        for (int i=0; i<SLIDING_WINDOW_SIZE; i++){
-            windowPower += *bufferPtr++; 
-        }
-        if (windowPower > maxWindowPower) {
-            maxWindowPower = windowPower;
-            transmissionFreqStart = j;
-        }
+    if (mon->bytesRead == 0) {
+        // start the clocks at the first data, not at startup
+        loadAnchor(mon, 0);
     }
+    mon->bytesRead += nBytesRead;
     
-    // finish summing the power in the buffer for the last SLIDING_WINDOW_SIZE samples
-    bufferPtr = &buffer[bufferLen - SLIDING_WINDOW_SIZE];
-    for (int i=0; i<SLIDING_WINDOW_SIZE; i++) {
-        accPower += *bufferPtr++;
+    wallUsecs = usecsSince(&mon->anchorTime);
+    if (wallUsecs - mon->lastCheck < LOAD_CHECK_INTERVAL) {
+        return;
     }
+    mon->lastCheck = wallUsecs;
     
-    // When calculating the average power, I want the average *outside* of the peak window.
-    // So subtract that from accPower
-    accPower -= maxWindowPower;
-    
-    float averagePower = accPower/(bufferLen - SLIDING_WINDOW_SIZE);
-    float peakPower    = maxWindowPower/SLIDING_WINDOW_SIZE;
-    
-    // for debug at least - find and print peak in window...
-/*    float localMaxima = -FLT_MAX;
-    bufferPtr = &buffer[transmissionFreqStart];
-    for (int i=0; i<SLIDING_WINDOW_SIZE; i++) {
-        localMaxima = MAX(localMaxima, *bufferPtr++);
-    }*/
-//    fprintf(stderr, "DEBUG - window maxima is %f, window power is %f\n", localMaxima, peakPower);
-//    fprintf(stderr, "DEBUG - accPower is %f\n", accPower);
-//    fprintf(stderr, "DEBUG - snr is %f, average power is %f\n", peakPower/averagePower, averagePower);
-
+    if (ioctl(mon->fd, FIONREAD, &pending) < 0) {
+        fprintf(stderr, "Cannot read pipe fill level, %s. Load shedding disabled\n", strerror(errno));
+        mon->enabled = false;
+        loadSetLevel(mon, LOAD_FULL);
+        return;
+    }
+    fill = (int)(pending*100LL/mon->pipeSize);
     
-    if (s2nr) {
-        *s2nr = peakPower/averagePower;
+    // Everything rtl_sdr produced since the anchor is either read or in the pipe. If
+    // the wall clock says there should be more than that, it was dropped upstream.
+    producedUsecs = (mon->bytesRead + pending - mon->anchorBytes)/2*1000000ULL/mon->rate;
+    if (producedUsecs > wallUsecs + LOAD_NOT_LIVE_LEAD) {
+        // faster than real time. Somebody is cat'ing a file at us.
+        fprintf(stderr, "Input is faster than real time, load shedding disabled\n");
+        mon->enabled = false;
+        loadSetLevel(mon, LOAD_FULL);
+        return;
     }
-    if (peak) {
-        *peak = transmissionFreqStart + SLIDING_WINDOW_SIZE/2;
+    if (wallUsecs > producedUsecs + LOAD_DRIFT_TOLERANCE) {
+        mon->nDrifts++;
+        mon->driftUsecs += wallUsecs - producedUsecs;
+        loadReport(mon, "DRIFT");
+        loadAnchor(mon, pending);
+    } else if (pending == 0) {
+        // caught up. Resync the clocks so crystal error doesn't accumulate.
+        loadAnchor(mon, pending);
     }
     
-    // XXX DEBUG
-    lastPeak = *peak;
-    lastSNR = *s2nr;
-    return true;
-}
-
-#if 0
-static bool signalPresent(float *buffer, int bufferLen) 
-{
-    float runningTotal = 0;
-    int nNonSignalPoints = 0;
-    float max = *buffer;
-    float min = max;
-    float *bufferPtr = buffer;
-    // walk through buffer, looking for value that exceeds THRESHOLD
-    for (int i=0; i<bufferLen; i++) {
-        float curVal = *bufferPtr++;
-        if (curVal < THRESHOLD) {
-            nNonSignalPoints++;
-            runningTotal += curVal;
+    if (fill >= LOAD_OVERRUN_WATER) {
+        if (!mon->overrunning) {
+            mon->nOverruns++;
+            mon->overrunning = true;
+            loadReport(mon, "OVERRUN");
         }
-        if (curVal  > max) {
-            max = curVal;
+    } else {
+        mon->overrunning = false;
+    }
+    
+    if (fill >= LOAD_HIGH_WATER) {
+        mon->calmChecks = 0;
+        if (mon->level < N_LOAD_LEVELS - 1) {
+            loadSetLevel(mon, (eLoadLevel)(mon->level + 1));
+            mon->nDegrades++;
+            loadReport(mon, "DEGRADE");
         }
-        if (curVal < min) {
-            min = curVal;
+    } else if (fill < LOAD_LOW_WATER) {
+        if (mon->level > LOAD_FULL && ++mon->calmChecks >= LOAD_CALM_CHECKS) {
+            mon->calmChecks = 0;
+            loadSetLevel(mon, (eLoadLevel)(mon->level - 1));
+            mon->nRecoveries++;
+            loadReport(mon, "RECOVER");
         }
+    } else {
+        mon->calmChecks = 0;
     }
-/*    if (max > THRESHOLD) {
-        fprintf(stderr, "Average is %f\n", runningTotal/nNonSignalPoints);
-        fprintf(stderr, "Max is %f, min is %f\n", max, min);
-    }
-*/
-    return ((max > THRESHOLD) && nNonSignalPoints > 0 && runningTotal/nNonSignalPoints < NOISE_THRESHOLD);
 }
-#endif //0
 
 
-void processChunk(unsigned char *charBuffer)
+static PulseBus *pulseBus = NULL;
+static DedupTable *dedupTable = NULL;
+
+static void emitBurst(void *context, const Packet *packet, unsigned int repeats, bool burstEnd)
 {
-    if (!bProcessingInit) {
-        fprintf(stderr, "Processing not initialized\n");
-        return;
+    (void)context;
+    if (burstEnd) {
+        busPublishBurst(pulseBus, 0, packet->startTime, packet->endTime - packet->startTime, 
+                        packet->sensorId, repeats, packet->bits, packet->snr);
+    } else {
+        busPublishPacket(pulseBus, 0, packet->startTime, packet->endTime - packet->startTime, 
+                         packet->sensorId, repeats, packet->bits, packet->snr);
     }
-    
-    convertToComplexFloat(charBuffer, sampleBuffer, chunkSize);
-    getFFT(sampleBuffer, dstBuffer);
-    processBuffer(dstBuffer, FFT_SIZE);
-    /*
-    int bHaveSignal = signalPresent(dstBuffer, chunkSize);
-    if (bHaveSignal && !signalDetected) {
-        signalDetected  = true;
-        // reset timebase if it's been more than 5 seconds since the previous signal
-        if (time(0) - timebase > 5) {
-            timebase = time(0);
-            nChunksRead = 0;
-        }
+}
 
-        signalStartTime = (nChunksRead*FFT_SIZE/8)/(((float)sampleRate)/1000000); 
-    } else if (!bHaveSignal && signalDetected) {
-        signalDetected  = false;
-        unsigned long signalStopTime  = (nChunksRead*FFT_SIZE/8)/(((float)sampleRate)/1000000);
-        emitSignal(signalStartTime, signalStopTime - signalStartTime);
+// repeats go no further than the dedup table
+static void emitPacket(void *context, const Packet *packet)
+{
+    (void)context;
+    latencyEmitted(TRACE_PACKET, packet->lastSample, packet->startTime, packet->endTime - packet->startTime);
+    if (dedupTable) {
+        dedupAdd(dedupTable, packet);
     }
-    nChunksRead++;
-    */
+}
+
+static void emitPulse(void *context, unsigned long startTime, unsigned long duration, unsigned long long lastSample,
+                      float snr)
+{
+    PacketDecoder *packetDecoder = (PacketDecoder *)context;
     
+    fprintf(stdout, "[%lu, %lu]\n", startTime, duration);
+    fflush(stdout); // yeah, the \n should flush it. Don't know wtf is happening
+    latencyEmitted(TRACE_PULSE, lastSample, startTime, duration);
+    if (pulseBus) {
+        busPublishPulse(pulseBus, 0, startTime, duration, snr);
+    }
+    if (packetDecoder) {
+        packetDecoderAccept(packetDecoder, startTime, duration, lastSample, snr);
+    }
+}
+
+// SIGUSR1 asks for a status report, for when we're running forever
+static volatile sig_atomic_t reportRequested = 0;
+
+static void reportSignalHandler(int sig)
+{
+    (void)sig;
+    reportRequested = 1;
 }
 
+// SIGUSR2 steps the log level, quiet -> warn -> info -> debug -> quiet
+static volatile sig_atomic_t logLevel = LOG_DEBUG;
 
+static void logLevelSignalHandler(int sig)
+{
+    (void)sig;
+    logLevel = (logLevel + 1) % (LOG_DEBUG + 1);
+    logSetLevel((eLogLevel)logLevel);     // NB - just an atomic store. Safe here.
+}
 
 int main(int argc, char *argv[])
 {
@@ -775,26 +579,73 @@ int main(int argc, char *argv[])
     int rate = 1000000;
     char *file = NULL;
     int fileno = STDIN_FILENO;
-    int bufferSize;
-    unsigned char *inputBuf;
-    unsigned char *inputPtr;
-    unsigned char *readPtr;
-    unsigned char *writePtr;
     int stride = FFT_SIZE/8;
-    int maxReadSize = FFT_SIZE;
     int nBytesRead;
-    int debugCounter = 0;
+    bool allowShedding = true;
+    LoadMonitor loadMonitor;
+    Detector *detector = NULL;
+    bool traceLatency = false;
+    char *traceFile = NULL;
+    unsigned long long bytesArrived = 0;   // a pipe read can end halfway through a sample
+    bool daemonMode = false;
+    int nWorkers = 0;
+    RtlTcpSettings rtlSettings = {0, 0, RTL_GAIN_AUTO};
+    RtlTcpClient *rtlClient = NULL;
+    int readSize = INPUT_READ_SIZE;
+    char *busName = NULL;
+    char *wisdomFile = NULL;
+    bool tune = false;
+    static const struct option longOptions[] = {
+        {"tune", no_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}
+    };
+    PacketDecoder *packetDecoder = NULL;
  
     int c;
     opterr = 0;
-    while ((c = getopt (argc, argv, "r:")) != -1) {
+    while ((c = getopt_long (argc, argv, "r:Flt:dw:f:g:b:v:W:", longOptions, NULL)) != -1) {
         switch (c)
         {
             case 'r':
                 rate = atoi(optarg);
                 break;
+            case 'F':
+                allowShedding = false;
+                break;
+            case 'l':
+                traceLatency = true;
+                break;
+            case 't':
+                traceLatency = true;
+                traceFile = optarg;
+                break;
+            case 'd':
+                daemonMode = true;
+                break;
+            case 'w':
+                nWorkers = atoi(optarg);
+                break;
+            case 'f':
+                rtlSettings.frequency = strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                rtlSettings.gain = atoi(optarg);
+                break;
+            case 'b':
+                busName = optarg;
+                break;
+            case 'v':
+                logLevel = atoi(optarg);
+                break;
+            case 'W':
+                wisdomFile = optarg;
+                break;
+            case 'T':
+                tune = true;
+                break;
             case '?':
-                if (optopt == 'r'){
+                if (optopt == 'r' || optopt == 't' || optopt == 'w' || optopt == 'f' || optopt == 'g' ||
+                    optopt == 'b' || optopt == 'v' || optopt == 'W'){
                     fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                     goto ErrExit;
                 } else if (isprint (optopt)) {
@@ -809,68 +660,160 @@ int main(int argc, char *argv[])
                 goto ErrExit;
         }
     }
+    
+    if (logLevel < LOG_QUIET || logLevel > LOG_DEBUG) {
+        goto ErrExit;
+    }
+    
+    if (tune) {
+        if (!wisdomFile || rate <= 0) {
+            goto ErrExit;
+        }
+        double usecs = processingTune(FFT_SIZE, wisdomFile);
+        if (usecs < 0) {
+            fprintf(stderr, "Cannot plan the FFT\n");
+            exit(-1);
+        }
+        // one FFT every stride samples
+        printf("At %d samples/sec, stride %d, FFTs take %.1f%% of a core\n", 
+               rate, stride, usecs*rate/stride/10000);
+        return 0;
+    }
+    if (!logStart(LOG_SLOTS, (eLogLevel)logLevel)) {
+        exit(-1);
+    }
+    signal(SIGUSR2, logLevelSignalHandler);
       
+    if (daemonMode) {
+        int nInputs = argc - optind;
+        if (nInputs <= 0 || rate <= 0 || nWorkers < 0) {
+            goto ErrExit;
+        }
+        if (traceLatency) {
+            fprintf(stderr, "Latency tracing is only available for a single stream. Ignoring\n");
+        }
+        if (nWorkers == 0) {
+            nWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        nWorkers = MAX(1, MIN(nWorkers, nInputs));
+        if (!processingInit(FFT_SIZE, wisdomFile)) {
+            fprintf(stderr, "Cannot initialize processing\n");
+            exit(-1);
+        }
+        if (busName && (pulseBus = busCreate(busName, BUS_SLOTS)) == NULL) {
+            exit(-1);
+        }
+        printf("Sample rate %d, stride %d, %d streams, %d workers\n", rate, stride, nInputs, nWorkers);
+        rtlSettings.sampleRate = rate;
+        int retVal = daemonRun(&argv[optind], nInputs, rate, stride, nWorkers, pulseBus, &rtlSettings);
+        busDestroy(pulseBus);
+        processingShutDown();
+        logShutDown();
+        return retVal;
+    }
+    
     if (optind < argc) {
         file = argv[optind];
     }
     
-    if (file != NULL) {
+    if (rate <= 0){ 
+        goto ErrExit;
+    }
+
+    if (file != NULL && strncmp(file, "tcp:", 4) == 0) {
+        rtlSettings.sampleRate = rate;
+        if ((rtlClient = rtlTcpCreate(file + 4, &rtlSettings)) == NULL) {
+            exit(-1);
+        }
+        fileno = rtlTcpFd(rtlClient);
+        readSize = NET_READ_SIZE;
+    } else if (file != NULL) {
         fileno = open(file, O_RDONLY);
         if (fileno <= 0) {
             goto ErrExit;
         }
     } 
-    
-    if (rate <= 0){ 
+
+    if (traceLatency && !latencyInit(traceFile, rate)) {
         goto ErrExit;
     }
+    signal(SIGUSR1, reportSignalHandler);
 
-    processingInit(FFT_SIZE, rate, stride);
+    if (busName) {
+        if ((pulseBus = busCreate(busName, BUS_SLOTS)) == NULL ||
+            (dedupTable = dedupCreate(rate, emitBurst, NULL)) == NULL) {
+            exit(-1);
+        }
+    }
+    // the packets are for the bus, and for the latency trace's packet stage
+    if ((busName || traceLatency) && (packetDecoder = packetDecoderCreate(emitPacket, NULL)) == NULL) {
+        exit(-1);
+    }
+    if (!processingInit(FFT_SIZE, wisdomFile) || 
+        (detector = detectorCreate(rate, stride, emitPulse, packetDecoder)) == NULL) {
+        fprintf(stderr, "Cannot initialize processing\n");
+        exit(-1);
+    }
+    loadInit(&loadMonitor, detector, fileno, stride, rate, allowShedding);
 
     printf("Sample rate %d, stride %d\n", rate, stride);
-    // read from file
-
-    // We need to deal with a sliding window with FFT_SIZE samples. I'm going to handle
-    // this by allocating a buffer three times the window size. When we've finished with
-    // all of the data in the first window, we copy the second and third windows up one,
-    // and reset the pointers.
-    bufferSize = FFT_SIZE*2*3; // NB - sample is complex, so two bytes
-    inputBuf = (unsigned char *)malloc(bufferSize);
-    inputPtr = inputBuf;
-    readPtr  = inputBuf;
-    maxReadSize = FFT_SIZE;
-    while((nBytesRead = read(fileno, inputPtr, maxReadSize)) > 0) {
-        debugCounter++;
-        inputPtr += nBytesRead;
-        while (inputPtr - readPtr >= FFT_SIZE*2) {  // as long as there are at least FFT_SIZE samples to process
-            processChunk(readPtr);
-            readPtr += stride*2;
-            if (readPtr - inputBuf > FFT_SIZE*2) {  // we're finished with FFT_SIZE samples. Copy the other two windows over
-                memcpy(inputBuf, inputBuf + FFT_SIZE*2, FFT_SIZE*2*2);
-                readPtr  -= FFT_SIZE*2;
-                inputPtr -= FFT_SIZE*2;
+    // Read straight into the detector, which deals with the sliding window.
+    for (;;) {
+        unsigned long long samplesLost = 0;
+        int room;
+        unsigned char *inputBuf = detectorInputSpace(detector, &room);
+        if (rtlClient) {
+            nBytesRead = rtlTcpRead(rtlClient, inputBuf, MIN(room, readSize), &samplesLost);
+            if (samplesLost) {
+                // reconnected. detectorInputDone keeps the clock going across the gap.
+                bytesArrived += samplesLost*2;
+                loadReconnected(&loadMonitor, rtlTcpFd(rtlClient));
             }
+        } else {
+            nBytesRead = read(fileno, inputBuf, MIN(room, readSize));
         }
-        maxReadSize = MIN(FFT_SIZE, (inputBuf + bufferSize) - inputPtr);
-/*        if (debugCounter > 100) {
+        if (nBytesRead <= 0) {
             break;
         }
-*/
-
-    }
-    
-    /*
-    while((nBytesRead = read(fileno, bufPtr, FFT_SIZE)) > 0) {
-        bufPtr += nBytesRead;
-        if (bufPtr - inputBuf >= bufferSize){
-            processChunk(inputBuf);
-            bufPtr = inputBuf;
+        bytesArrived += nBytesRead;
+        latencyInputArrived(bytesArrived/2);
+        loadCheck(&loadMonitor, nBytesRead);
+        if (stride != loadStride(&loadMonitor)) {
+            stride = loadStride(&loadMonitor);
+            detectorSetStride(detector, stride);
+        }
+        detectorInputDone(detector, nBytesRead, samplesLost);
+        if (dedupTable) {
+            dedupExpire(dedupTable, bytesArrived/2);
+        }
+        if (reportRequested) {
+            reportRequested = 0;
+            latencyReport();
+            if (loadMonitor.enabled) {
+                loadReport(&loadMonitor, "STATUS");
+            }
         }
     }
-    */
     
-    close(fileno);
+    if (loadMonitor.enabled) {
+        loadReport(&loadMonitor, "SUMMARY");
+    }
+    latencyReport();
+    latencyShutDown();
+    if (rtlClient) {
+        rtlTcpDestroy(rtlClient);
+    } else {
+        close(fileno);
+    }
+    detectorDestroy(detector);
+    if (dedupTable) {
+        dedupFlush(dedupTable);
+        dedupDestroy(dedupTable);
+    }
+    packetDecoderDestroy(packetDecoder);
+    busDestroy(pulseBus);
     processingShutDown();
+    logShutDown();
     
     return 0;  
     
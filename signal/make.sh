@@ -1 +1,2 @@
-gcc main.cpp -lfftw3f -lm -o signal_process
+gcc main.cpp detector.cpp daemon.cpp rtltcp.cpp packet.cpp dedup.cpp pulsebus.cpp diaglog.cpp -lfftw3f -lm -lpthread -lrt -o signal_process
+gcc -shared -fPIC detector.cpp diaglog.cpp pulsebus.cpp libdetector.cpp -lfftw3f -lm -lpthread -lrt -o libdetector.so
@@ -0,0 +1,175 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "packet.h"
+#include "diaglog.h"
+
+// pulse lengths in microseconds. Keep in step with decoder.py
+#define MIN_START_LEN       700
+#define MAX_START_LEN       1200
+#define MIN_STOP_LEN        400
+#define MAX_STOP_LEN        500
+#define MIN_DATA_PULSE_LEN  65
+#define MAX_DATA_PULSE_LEN  150
+#define MIN_LONG_LEN        200
+#define MAX_LONG_LEN        340
+#define MIN_SHORT_LEN       60
+#define MAX_SHORT_LEN       190
+
+#define MAX_MSG_BITS        55
+
+#define SENSOR_ID_START     12
+#define SENSOR_ID_BITS      24
+
+typedef enum {
+    PENDING_SIGNAL,
+    BITS,
+    PENDING_END,
+    CHECKSUM
+} ePacketState;
+
+struct PacketDecoder {
+    ePacketState state;
+    unsigned long lastSignalTime;
+    unsigned long packetStart;
+    uint64_t bits;
+    int nBits;
+    float snr;
+    PacketEmitFunc emit;
+    void *emitContext;
+};
+
+PacketDecoder *packetDecoderCreate(PacketEmitFunc emit, void *emitContext)
+{
+    PacketDecoder *decoder = (PacketDecoder *)calloc(1, sizeof(PacketDecoder));
+    if (decoder) {
+        decoder->state = PENDING_SIGNAL;
+        decoder->emit = emit;
+        decoder->emitContext = emitContext;
+    }
+    return decoder;
+}
+
+void packetDecoderDestroy(PacketDecoder *decoder)
+{
+    free(decoder);
+}
+
+static void resetPacket(PacketDecoder *decoder)
+{
+    decoder->state = PENDING_SIGNAL;
+    decoder->lastSignalTime = 0;
+    decoder->bits = 0;
+    decoder->nBits = 0;
+    decoder->snr = 0;
+}
+
+// Information is in the gap between pulses. Long is 0, short is 1.
+static bool emitBit(PacketDecoder *decoder, unsigned long deltaTime)
+{
+    int bit;
+
+    if (deltaTime >= MIN_LONG_LEN && deltaTime <= MAX_LONG_LEN) {
+        bit = 0;
+    } else if (deltaTime >= MIN_SHORT_LEN && deltaTime <= MAX_SHORT_LEN) {
+        bit = 1;
+    } else {
+        logEvent(LOG_BAD_DISTANCE, deltaTime, 0, 0, 0, 0);
+        resetPacket(decoder);
+        return false;
+    }
+    decoder->bits = (decoder->bits << 1) | bit;
+    decoder->nBits++;
+    return true;
+}
+
+static void emitPacket(PacketDecoder *decoder, unsigned long endTime, unsigned long long lastSample)
+{
+    Packet packet;
+
+    packet.startTime  = decoder->packetStart;
+    packet.endTime    = endTime;
+    packet.lastSample = lastSample;
+    packet.snr        = decoder->snr;
+    packet.bits       = decoder->bits;
+    packet.sensorId   = (uint32_t)(decoder->bits >> (PACKET_BITS - SENSOR_ID_START - SENSOR_ID_BITS)) &
+                        ((1u << SENSOR_ID_BITS) - 1);
+    decoder->emit(decoder->emitContext, &packet);
+}
+
+void packetDecoderAccept(PacketDecoder *decoder, unsigned long startTime, unsigned long duration,
+                         unsigned long long lastSample, float snr)
+{
+    // NB - pulse times wrap to zero when the detector resets its timebase. Anything
+    // in progress is garbage then, and the bad distance will throw it out.
+    unsigned long deltaTime = startTime - decoder->lastSignalTime;
+    bool isDataPulse = (duration >= MIN_DATA_PULSE_LEN && duration <= MAX_DATA_PULSE_LEN);
+
+    // anything that turns up mid-packet is part of the transmission
+    if (decoder->state != PENDING_SIGNAL && snr > decoder->snr) {
+        decoder->snr = snr;
+    }
+
+    switch (decoder->state) {
+    case PENDING_SIGNAL:
+        if (duration < MIN_START_LEN || duration > MAX_START_LEN) {
+            goto Unexpected;
+        }
+        decoder->packetStart = startTime;
+        decoder->snr = snr;
+        decoder->state = BITS;
+        break;
+    case BITS:
+        if (!isDataPulse) {
+            goto Unexpected;
+        }
+        if (!emitBit(decoder, deltaTime)) {
+            return;
+        }
+        if (decoder->nBits >= MAX_MSG_BITS - 1) {   // NB - last bit comes with the end signal
+            decoder->state = PENDING_END;
+        }
+        break;
+    case PENDING_END:
+        if (duration < MIN_STOP_LEN || duration > MAX_STOP_LEN) {
+            goto Unexpected;
+        }
+        if (!emitBit(decoder, deltaTime)) {
+            return;
+        }
+        decoder->state = CHECKSUM;
+        break;
+    case CHECKSUM:
+        if (isDataPulse && !emitBit(decoder, deltaTime)) {
+            return;
+        }
+        if (decoder->nBits >= PACKET_BITS) {
+            emitPacket(decoder, startTime + duration, lastSample);
+            resetPacket(decoder);
+        }
+        break;
+    }
+    decoder->lastSignalTime = startTime + duration;
+    return;
+
+Unexpected:
+    logEvent(LOG_UNEXPECTED_PULSE, startTime, 0, 0, duration, decoder->state);
+}
@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+/* GE packet decoder. Turns pulses from the detector into packets. This is the same
+   state machine as decode/decoder.py - see there for what the pulses mean. One
+   decoder per stream of pulses. */
+
+#define PACKET_BITS 59          // 55 message bits and a 4 bit checksum
+
+typedef struct {
+    unsigned long startTime;    // usecs, start of the start pulse
+    unsigned long endTime;      // usecs, end of the last pulse
+    unsigned long long lastSample;  // detector's sample count at the end. Never resets
+    uint32_t sensorId;          // 24 bits, bits 12-35 of the packet
+    uint64_t bits;              // the whole packet, first bit received in the top bit (58)
+    float snr;                  // dB, best of its pulses
+} Packet;
+
+typedef void (*PacketEmitFunc)(void *context, const Packet *packet);
+
+typedef struct PacketDecoder PacketDecoder;
+
+PacketDecoder *packetDecoderCreate(PacketEmitFunc emit, void *emitContext);
+void packetDecoderDestroy(PacketDecoder *decoder);
+
+// Feed it every pulse, in order, as the detector emits them. Calls emit for each
+// complete packet.
+void packetDecoderAccept(PacketDecoder *decoder, unsigned long startTime, unsigned long duration,
+                         unsigned long long lastSample, float snr);
+
+// The packet after the sensor id, as in decoder.py's "raw" - whole nibbles from bit 36,
+// so bits 36-55. The last 3 bits of the checksum aren't in it.
+#define PAYLOAD_START 36
+#define PAYLOAD_BITS  20
+static inline uint32_t packetPayload(const Packet *packet)
+{
+    return (uint32_t)(packet->bits >> (PACKET_BITS - PAYLOAD_START - PAYLOAD_BITS)) & ((1u << PAYLOAD_BITS) - 1);
+}
+
+#endif // PACKET_H
@@ -0,0 +1,267 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pulsebus.h"
+
+#define BUS_NAME_MAX 256
+
+struct PulseBus {
+    char name[BUS_NAME_MAX];
+    int fd;
+    size_t size;
+    BusHeader *header;
+    BusSlot *slots;
+    uint32_t mask;
+    uint64_t seq;           // last record published
+};
+
+struct BusReader {
+    int fd;
+    size_t size;
+    const BusHeader *header;
+    const BusSlot *slots;
+    uint32_t nSlots;
+    uint64_t nextSeq;
+};
+
+// shm_open wants a leading slash. Let people leave it off.
+static bool shmName(const char *name, char *shmName)
+{
+    if (snprintf(shmName, BUS_NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name) >= BUS_NAME_MAX ||
+        strchr(shmName + 1, '/') != NULL) {
+        fprintf(stderr, "Bad bus name %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+PulseBus *busCreate(const char *name, unsigned int nSlots)
+{
+    PulseBus *bus = (PulseBus *)calloc(1, sizeof(PulseBus));
+    unsigned int size = 1;
+
+    if (!bus || !shmName(name, bus->name)) {
+        free(bus);
+        return NULL;
+    }
+    while (size < nSlots) {
+        size <<= 1;
+    }
+    nSlots = size;
+    bus->size = sizeof(BusHeader) + nSlots*sizeof(BusSlot);
+
+    // Start from scratch. Anybody still attached to an old one keeps it until they let go.
+    shm_unlink(bus->name);
+    bus->fd = shm_open(bus->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (bus->fd < 0 || ftruncate(bus->fd, bus->size) < 0) {
+        fprintf(stderr, "Cannot create bus %s, %s\n", name, strerror(errno));
+        goto ErrExit;
+    }
+    bus->header = (BusHeader *)mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED, bus->fd, 0);
+    if (bus->header == MAP_FAILED) {
+        fprintf(stderr, "Cannot map bus %s, %s\n", name, strerror(errno));
+        bus->header = NULL;
+        goto ErrExit;
+    }
+    bus->slots = (BusSlot *)(bus->header + 1);
+    bus->mask = nSlots - 1;
+
+    // ftruncate zeroed it, so all the slots are empty
+    bus->header->version = BUS_VERSION;
+    bus->header->slotSize = sizeof(BusSlot);
+    bus->header->nSlots = nSlots;
+    bus->header->producerPid = getpid();
+    bus->header->writeSeq = 0;
+    __atomic_store_n(&bus->header->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+    return bus;
+
+ErrExit:
+    busDestroy(bus);
+    return NULL;
+}
+
+void busDestroy(PulseBus *bus)
+{
+    if (!bus) {
+        return;
+    }
+    if (bus->header) {
+        munmap(bus->header, bus->size);
+    }
+    if (bus->fd >= 0) {
+        close(bus->fd);
+        shm_unlink(bus->name);
+    }
+    free(bus);
+}
+
+void busPublish(PulseBus *bus, const BusRecord *record)
+{
+    uint64_t seq = ++bus->seq;
+    BusSlot *slot = &bus->slots[seq & bus->mask];
+
+    // odd while we're writing, so a reader who catches us in the middle knows it
+    __atomic_store_n(&slot->seq, 2*seq - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = *record;
+    __atomic_store_n(&slot->seq, 2*seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&bus->header->writeSeq, seq, __ATOMIC_RELEASE);
+}
+
+void busPublishPulse(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration, float snr)
+{
+    BusRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.type = BUS_PULSE;
+    record.stream = (uint16_t)stream;
+    record.startTime = startTime;
+    record.duration = (uint32_t)duration;
+    record.snr = snr;
+    busPublish(bus, &record);
+}
+
+static void publishPacketRecord(PulseBus *bus, eBusRecordType type, int stream, unsigned long startTime,
+                                unsigned long duration, uint32_t sensorId, uint32_t repeats, uint64_t bits, float snr)
+{
+    BusRecord record;
+
+    record.type = type;
+    record.stream = (uint16_t)stream;
+    record.startTime = startTime;
+    record.duration = (uint32_t)duration;
+    record.sensorId = sensorId;
+    record.repeats = repeats;
+    record.bits = bits;
+    record.snr = snr;
+    record.reserved = 0;
+    busPublish(bus, &record);
+}
+
+void busPublishPacket(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration,
+                      uint32_t sensorId, uint32_t repeats, uint64_t bits, float snr)
+{
+    publishPacketRecord(bus, BUS_PACKET, stream, startTime, duration, sensorId, repeats, bits, snr);
+}
+
+void busPublishBurst(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration,
+                     uint32_t sensorId, uint32_t repeats, uint64_t bits, float snr)
+{
+    publishPacketRecord(bus, BUS_BURST, stream, startTime, duration, sensorId, repeats, bits, snr);
+}
+
+BusReader *busAttach(const char *name)
+{
+    BusReader *reader = (BusReader *)calloc(1, sizeof(BusReader));
+    char path[BUS_NAME_MAX];
+    struct stat st;
+
+    if (!reader || !shmName(name, path)) {
+        free(reader);
+        return NULL;
+    }
+    reader->fd = shm_open(path, O_RDONLY, 0);
+    if (reader->fd < 0 || fstat(reader->fd, &st) < 0) {
+        fprintf(stderr, "Cannot open bus %s, %s\n", name, strerror(errno));
+        goto ErrExit;
+    }
+    reader->size = st.st_size;
+    if (reader->size < sizeof(BusHeader)) {
+        fprintf(stderr, "Bus %s is not ready\n", name);
+        goto ErrExit;
+    }
+    reader->header = (const BusHeader *)mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (reader->header == MAP_FAILED) {
+        fprintf(stderr, "Cannot map bus %s, %s\n", name, strerror(errno));
+        reader->header = NULL;
+        goto ErrExit;
+    }
+    if (__atomic_load_n(&reader->header->magic, __ATOMIC_ACQUIRE) != BUS_MAGIC ||
+        reader->header->version != BUS_VERSION || reader->header->slotSize != sizeof(BusSlot) ||
+        reader->size < sizeof(BusHeader) + reader->header->nSlots*sizeof(BusSlot)) {
+        fprintf(stderr, "Bus %s is not ready, or is not a pulse bus\n", name);
+        goto ErrExit;
+    }
+    reader->slots = (const BusSlot *)(reader->header + 1);
+    reader->nSlots = reader->header->nSlots;
+    reader->nextSeq = __atomic_load_n(&reader->header->writeSeq, __ATOMIC_ACQUIRE) + 1;
+    return reader;
+
+ErrExit:
+    busDetach(reader);
+    return NULL;
+}
+
+void busDetach(BusReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+    if (reader->header) {
+        munmap((void *)reader->header, reader->size);
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader);
+}
+
+int busRead(BusReader *reader, BusRecord *record, uint64_t *lost)
+{
+    if (lost) {
+        *lost = 0;
+    }
+    for (;;) {
+        uint64_t seq = reader->nextSeq;
+        const BusSlot *slot = &reader->slots[seq & (reader->nSlots - 1)];
+        uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (before < 2*seq) {
+            // still the previous lap, or being written now
+            return 0;
+        }
+        if (before == 2*seq) {
+            memcpy(record, (const void *)&slot->record, sizeof(*record));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == before) {
+                reader->nextSeq++;
+                return 1;
+            }
+        }
+
+        // Lapped - the producer has been round since. Pick up half a ring behind it,
+        // so there's some room before it laps us again.
+        uint64_t writeSeq = __atomic_load_n(&reader->header->writeSeq, __ATOMIC_ACQUIRE);
+        uint64_t resume = (writeSeq > reader->nSlots/2) ? writeSeq - reader->nSlots/2 + 1 : 1;
+        if (resume <= seq) {
+            resume = seq + 1;   // can't happen, unless the producer went backwards
+        }
+        if (lost) {
+            *lost += resume - seq;
+        }
+        reader->nextSeq = resume;
+    }
+}
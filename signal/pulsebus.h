@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PULSEBUS_H
+#define PULSEBUS_H
+
+#include <stdint.h>
+
+/* Pulse bus. A ring of fixed size records in POSIX shared memory (/dev/shm/<name>),
+   written by one producer and read by any number of consumers. The producer never
+   waits for anybody; consumers come and go as they please, and one that falls more
+   than a ring's worth behind finds out it was lapped, and how many records it missed.
+
+   Layout, all little endian (this is what decode/pulsebus.py reads):
+
+     BusHeader    64 bytes
+     BusSlot      nSlots of them, 48 bytes each
+
+   Every record has a sequence number, counting from 1. Record n goes in slot
+   n % nSlots, and the slot's seq is 2n-1 while it's being written, 2n once it's
+   done. A reader copies the record, and checks that seq didn't change underneath it.
+
+   If the producer restarts, it makes a new bus under the same name; readers have to
+   attach again to see it. */
+
+#define BUS_MAGIC     0x53554257        // "WBUS"
+#define BUS_VERSION   3
+
+typedef enum {
+    BUS_PULSE  = 1,
+    BUS_PACKET = 2,         // the first copy of a packet, as soon as it's decoded
+    BUS_BURST  = 3          // the sensor's gone quiet after repeating a BUS_PACKET
+} eBusRecordType;
+
+typedef struct {
+    uint16_t type;          // eBusRecordType
+    uint16_t stream;        // input's position in the list, in daemon mode. 0 otherwise
+    uint32_t duration;      // usecs. For packets, from the start pulse to the end
+    uint64_t startTime;     // usecs, on the detector's timebase
+    uint32_t sensorId;      // packets and bursts only
+    uint32_t repeats;       // packets and bursts only. Copies seen - always 1 for a packet
+    uint64_t bits;          // packets and bursts only. Packet bits, first bit received at the top
+    float snr;              // dB. For bursts, the best copy
+    uint32_t reserved;
+} BusRecord;
+
+typedef struct {
+    uint64_t seq;
+    BusRecord record;
+} BusSlot;
+
+typedef struct {
+    uint32_t magic;         // written last, once everything else is ready
+    uint16_t version;
+    uint16_t slotSize;
+    uint32_t nSlots;        // power of two
+    uint32_t producerPid;
+    uint64_t writeSeq;      // last record completely written
+    uint64_t reserved[5];
+} BusHeader;
+
+typedef struct PulseBus PulseBus;
+typedef struct BusReader BusReader;
+
+// Producer. Creates (or takes over) the named bus. nSlots is rounded up to a power of
+// two. Not thread safe - with more than one thread publishing, the caller serializes.
+PulseBus *busCreate(const char *name, unsigned int nSlots);
+void busDestroy(PulseBus *bus);     // unlinks it, too. Attached readers keep their copy
+void busPublish(PulseBus *bus, const BusRecord *record);
+void busPublishPulse(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration, float snr);
+void busPublishPacket(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration,
+                      uint32_t sensorId, uint32_t repeats, uint64_t bits, float snr);
+void busPublishBurst(PulseBus *bus, int stream, unsigned long startTime, unsigned long duration,
+                     uint32_t sensorId, uint32_t repeats, uint64_t bits, float snr);
+
+// Consumer. Starts with the next record published after attaching.
+BusReader *busAttach(const char *name);
+void busDetach(BusReader *reader);
+
+// Returns 1 and fills in record if there's a record waiting, 0 if not. If we were
+// lapped, *lost (if not NULL) gets the number of records skipped.
+int busRead(BusReader *reader, BusRecord *record, uint64_t *lost);
+
+#endif // PULSEBUS_H
@@ -0,0 +1,119 @@
+#
+# Decode regression check. Makes synthetic GE captures, runs them through
+# signal_process and the packet decoder, and counts the packets that come out.
+#
+
+import argparse
+import contextlib
+import io
+import json
+import logging
+import math
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "decode"))
+import decoder
+
+''' The captures are FSK, like the real thing: a strong tone for the signal and a
+weaker one for the space, with the go_right packet from decoder.py for timing.
+Each packet is surrounded by background noise, and optionally led by the space
+'preamble' some sensors send - the synch has to cope both with and without it,
+and with a preamble too weak to be told from the noise. '''
+
+RATE = 1000000          # samples/sec - the signal_process default
+SIGNAL_FREQ = 0.11      # cycles/sample
+SPACE_FREQ = -0.2
+SIGNAL_AMP = 0.8
+PREAMBLE_LEN = 40000    # usecs
+
+# name, preamble, background noise, noise on the tones, space amplitude
+SCENARIOS = [("no preamble",           False, 0.15, 0.03, 0.15),
+             ("preamble",              True,  0.15, 0.03, 0.15),
+             ("no preamble, noisy",    False, 0.15, 0.06, 0.2),
+             ("preamble, noisy",       True,  0.15, 0.06, 0.2),
+             ("weak preamble",         True,  0.15, 0.15, 0.2)]
+
+class Capture:
+    ''' Raw rtl_sdr output - unsigned 8 bit I/Q '''
+    def __init__(self, seed):
+        self.data = bytearray()
+        self.phase = 0.0
+        self.random = random.Random(seed)
+
+    def tone(self, usecs, freq, amp, noise):
+        for i in range(usecs*RATE//1000000):
+            self.phase += 2*math.pi*freq
+            i_ = amp*math.cos(self.phase) + self.random.gauss(0, noise)
+            q_ = amp*math.sin(self.phase) + self.random.gauss(0, noise)
+            self.data.append(max(0, min(255, int(127.4 + i_*128))))
+            self.data.append(max(0, min(255, int(127.4 + q_*128))))
+
+def makeCapture(nPackets, preamble, noise, toneNoise, spaceAmp, seed):
+    capture = Capture(seed)
+    for n in range(nPackets):
+        capture.tone(30000 + capture.random.randint(0, 5000), 0, 0, noise)
+        if preamble:
+            capture.tone(PREAMBLE_LEN, SPACE_FREQ, spaceAmp, toneNoise)
+        end = 0
+        for start, length in decoder.go_right:
+            if start > end:
+                capture.tone(start - end, SPACE_FREQ, spaceAmp, toneNoise)
+            capture.tone(length, SIGNAL_FREQ, SIGNAL_AMP, toneNoise)
+            end = start + length
+        capture.tone(300, SPACE_FREQ, spaceAmp, toneNoise)
+        capture.tone(30000, 0, 0, noise)
+    return bytes(capture.data)
+
+def countPackets(binary, captureFile):
+    ''' Run the capture through signal_process and the decoder. Returns the number of 
+    start pulses (packets the synch found) and the number of packets decoded - the 
+    second also depends on every data pulse coming through clean. '''
+    output = subprocess.run([binary, captureFile], stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL, check=True).stdout
+    synched = 0
+    decoded = [0]
+    decoder.listeners = [lambda *args: decoded.__setitem__(0, decoded[0] + 1)]
+    decoder.isRepeat = lambda key, now: False   # every copy counts here, not one per burst
+    decoder.reset()
+    with contextlib.redirect_stdout(io.StringIO()):
+        for line in output.decode().splitlines():
+            if line.startswith("["):
+                startTime, length = json.loads(line)[:2]
+                if decoder.MIN_START_LEN <= length <= decoder.MAX_START_LEN:
+                    synched += 1
+                decoder.acceptSignal(startTime, length)
+    return synched, decoded[0]
+
+def main():
+    parser = argparse.ArgumentParser(description="Check signal_process still decodes synthetic GE packets")
+    parser.add_argument("-b", "--binary", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "signal_process"))
+    parser.add_argument("--baseline", help="older signal_process to compare against")
+    parser.add_argument("-n", "--packets", type=int, default=5, help="packets per capture")
+    parser.add_argument("-s", "--seeds", type=int, default=2, help="captures per scenario")
+    args = parser.parse_args()
+
+    logging.disable(logging.CRITICAL)
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        captureFile = os.path.join(tmp, "capture.iq")
+        for name, preamble, noise, toneNoise, spaceAmp in SCENARIOS:
+            for seed in range(1, args.seeds + 1):
+                with open(captureFile, "wb") as f:
+                    f.write(makeCapture(args.packets, preamble, noise, toneNoise, spaceAmp, seed))
+                synched, decoded = countPackets(args.binary, captureFile)
+                result = "synched {}/{}, decoded {}".format(synched, args.packets, decoded)
+                ok = synched == args.packets
+                if args.baseline:
+                    baseSynched, baseDecoded = countPackets(args.baseline, captureFile)
+                    result += " (baseline {}, {})".format(baseSynched, baseDecoded)
+                    ok = ok and decoded >= baseDecoded
+                print("{}, seed {}: {}{}".format(name, seed, result, "" if ok else "  FAIL"))
+                failed = failed or not ok
+    return 1 if failed else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,123 @@
+#
+# Stand-in rtl_tcp server. Replays a capture file (raw rtl_sdr output) to whoever
+# connects, so signal_process tcp:host:port can be tried out without a dongle.
+#
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+''' Speaks just enough of the rtl_tcp protocol: the 12 byte "RTL0" header (tuner type,
+number of gain steps, big endian), then raw samples. Commands from the client are 5
+bytes, command then big endian parameter; we log them and, for the sample rate,
+pace the replay to match. '''
+
+TUNER_R820T = 5
+R820T_GAIN_STEPS = 29
+
+COMMANDS = {1: "frequency", 2: "sample rate", 3: "gain mode", 4: "gain",
+            5: "freq correction", 8: "agc mode"}
+
+BLOCK_SIZE = 16384      # bytes per send, about what rtl_tcp sends
+
+def readCommands(conn, radio):
+    ''' Handle whatever commands are waiting, without blocking '''
+    conn.setblocking(False)
+    try:
+        while True:
+            cmd = conn.recv(5)
+            if not cmd:
+                return False
+            while len(cmd) < 5:
+                conn.setblocking(True)
+                cmd += conn.recv(5 - len(cmd))
+                conn.setblocking(False)
+            command, param = struct.unpack(">BI", cmd)
+            sys.stderr.write("command: {} {}\n".format(COMMANDS.get(command, command), param))
+            if command == 2 and param > 0:
+                radio["rate"] = param
+    except BlockingIOError:
+        pass
+    finally:
+        conn.setblocking(True)
+    return True
+
+def serve(conn, samples, radio, args):
+    ''' Stream the capture in real time, like a live dongle would - anything that goes
+    by while nobody is connected is gone. Returns False when the capture is done. '''
+    conn.sendall(b"RTL0" + struct.pack(">II", TUNER_R820T, R820T_GAIN_STEPS))
+    total = len(samples)*args.loops
+    position = radio["position"]
+    sentHere = 0
+    try:
+        while position < total:
+            if not readCommands(conn, radio):
+                break
+            offset = position % len(samples)
+            block = samples[offset:offset + BLOCK_SIZE]
+            conn.sendall(block)
+            position += len(block)
+            sentHere += len(block)
+            if args.drop_after and sentHere >= args.drop_after:
+                sys.stderr.write("dropping the connection after {} bytes\n".format(sentHere))
+                args.drop_after = 0     # only the once
+                break
+            if not args.fast:
+                ahead = radio["start"] + position/2/radio["rate"] - time.monotonic()
+                if ahead > 0:
+                    time.sleep(ahead)
+    finally:
+        # NB - the client going away mid-send is a disconnect like any other. Pick up from here.
+        radio["position"] = position
+        radio["pausedAt"] = time.monotonic()
+    return position < total
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a capture file as an rtl_tcp server")
+    parser.add_argument("capture", help="raw rtl_sdr capture (unsigned 8 bit I/Q)")
+    parser.add_argument("-a", "--address", default="127.0.0.1")
+    parser.add_argument("-p", "--port", type=int, default=1234)
+    parser.add_argument("-r", "--rate", type=int, default=1000000,
+                        help="sample rate until the client sets one")
+    parser.add_argument("-n", "--loops", type=int, default=1, help="times to replay the capture")
+    parser.add_argument("-d", "--drop-after", type=int, default=0,
+                        help="drop the first connection after this many bytes, to test reconnects")
+    parser.add_argument("-f", "--fast", action="store_true", help="send as fast as possible")
+    parser.add_argument("-1", "--once", action="store_true",
+                        help="exit after the capture has been sent, rather than waiting for more clients")
+    args = parser.parse_args()
+
+    with open(args.capture, "rb") as f:
+        samples = f.read()
+
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind((args.address, args.port))
+    listener.listen(1)
+    sys.stderr.write("Listening on {}:{}\n".format(args.address, args.port))
+
+    radio = {"rate": args.rate, "position": 0, "start": 0, "pausedAt": 0}
+    while True:
+        conn, peer = listener.accept()
+        sys.stderr.write("Client {}:{}\n".format(*peer[:2]))
+        if radio["position"] == 0:
+            radio["start"] = time.monotonic()
+        elif not args.fast:
+            # the radio kept going while nobody was listening
+            radio["position"] += int((time.monotonic() - radio["pausedAt"])*radio["rate"])*2
+        try:
+            more = serve(conn, samples, radio, args)
+        except (BrokenPipeError, ConnectionResetError):
+            sys.stderr.write("Client went away\n")
+            more = True
+        conn.close()
+        if not more:
+            sys.stderr.write("End of capture\n")
+            if args.once:
+                break
+            radio["position"] = 0
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,287 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "rtltcp.h"
+
+#ifndef MIN
+#define MIN(a,b) (a<b?a:b)
+#endif
+
+// rtl_tcp protocol. The server starts with a 12 byte header - "RTL0", then the tuner
+// type and the number of gain steps, big endian. After that it's raw samples one way,
+// and 5 byte commands (1 byte command, 4 byte big endian parameter) the other.
+#define RTL_HEADER_SIZE       12
+#define RTL_CMD_FREQUENCY     0x01
+#define RTL_CMD_SAMPLE_RATE   0x02
+#define RTL_CMD_GAIN_MODE     0x03
+#define RTL_CMD_GAIN          0x04
+
+#define RTL_RCVBUF_SIZE       (1 << 20)     // let the kernel hold on to bursts while we're busy
+#define RTL_STALL_TIMEOUT     5             // secs without data before we reconnect
+#define RTL_RETRY_MIN         100           // msecs between reconnect attempts, doubling...
+#define RTL_RETRY_MAX         5000          // ...up to this
+#define RTL_LOST_MAX_SECS     10            // a longer gap is more likely the wall clock jumping
+
+struct RtlTcpClient {
+    char *host;
+    char *port;
+    RtlTcpSettings settings;
+    int fd;
+    unsigned long long connectTime;         // usecs, monotonic
+    unsigned long long samplesReceived;     // on this connection
+    bool haveCarry;             // odd byte left over from the last read
+    unsigned char carry;
+};
+
+static const char *tunerNames[] = {"unknown", "E4000", "FC0012", "FC0013", "FC2580", "R820T", "R828D"};
+
+static unsigned long long monotonicUsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000ULL + now.tv_nsec/1000;
+}
+
+static bool sendCommand(int fd, unsigned char command, uint32_t param)
+{
+    unsigned char cmd[5];
+
+    cmd[0] = command;
+    param = htonl(param);
+    memcpy(&cmd[1], &param, sizeof(param));
+    return (send(fd, cmd, sizeof(cmd), MSG_NOSIGNAL) == sizeof(cmd));
+}
+
+static bool readFully(int fd, unsigned char *buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int connectToServer(RtlTcpClient *client)
+{
+    struct addrinfo hints, *addrs, *addr;
+    unsigned char header[RTL_HEADER_SIZE];
+    struct timeval timeout = {RTL_STALL_TIMEOUT, 0};
+    int rcvBufSize = RTL_RCVBUF_SIZE;
+    int noDelay = 1;
+    int fd = -1;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(client->host, client->port, &hints, &addrs)) != 0) {
+        fprintf(stderr, "Cannot find %s, %s\n", client->host, gai_strerror(err));
+        return -1;
+    }
+    for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        // NB - the receive buffer has to be set before connecting to affect the window
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBufSize, sizeof(rcvBufSize));
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to %s:%s, %s\n", client->host, client->port, strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (!readFully(fd, header, sizeof(header)) || memcmp(header, "RTL0", 4) != 0) {
+        fprintf(stderr, "%s:%s is not an rtl_tcp server\n", client->host, client->port);
+        close(fd);
+        return -1;
+    }
+    uint32_t tuner, nGains;
+    memcpy(&tuner, &header[4], sizeof(tuner));
+    memcpy(&nGains, &header[8], sizeof(nGains));
+    tuner = ntohl(tuner);
+    nGains = ntohl(nGains);
+    fprintf(stderr, "Connected to %s:%s, tuner %s, %u gain steps\n", client->host, client->port,
+            tuner < sizeof(tunerNames)/sizeof(tunerNames[0]) ? tunerNames[tuner] : tunerNames[0], nGains);
+
+    RtlTcpSettings *settings = &client->settings;
+    bool ok = sendCommand(fd, RTL_CMD_SAMPLE_RATE, settings->sampleRate);
+    if (ok && settings->frequency) {
+        ok = sendCommand(fd, RTL_CMD_FREQUENCY, settings->frequency);
+    }
+    if (ok && settings->gain != RTL_GAIN_AUTO) {
+        ok = sendCommand(fd, RTL_CMD_GAIN_MODE, 1) && sendCommand(fd, RTL_CMD_GAIN, settings->gain);
+    } else if (ok) {
+        ok = sendCommand(fd, RTL_CMD_GAIN_MODE, 0);
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot configure %s:%s, %s\n", client->host, client->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Keep trying until we get a connection. Returns the number of samples the dongle 
+// produced that we never got.
+static unsigned long long reconnect(RtlTcpClient *client)
+{
+    unsigned int retry = RTL_RETRY_MIN;
+    unsigned long long rate = client->settings.sampleRate;
+    unsigned long long downTime = monotonicUsecs();
+
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    client->haveCarry = false;  // half a sample. The rest of it is gone.
+
+    while ((client->fd = connectToServer(client)) < 0) {
+        usleep(retry*1000);
+        retry = MIN(retry*2, RTL_RETRY_MAX);
+    }
+    // The dongle runs in real time whether we're reading or not. Whatever it should 
+    // have produced since we connected, less what we got, is gone. (If we were behind,
+    // that includes whatever was still queued on the server when the connection went.)
+    unsigned long long now = monotonicUsecs();
+    unsigned long long expected = (now - client->connectTime)*rate/1000000;
+    unsigned long long lost = (expected > client->samplesReceived) ? expected - client->samplesReceived : 0;
+    // It's only an estimate, off the wall clock. Don't let a suspend or a clock step 
+    // turn into a skip of hours.
+    bool clamped = (lost > RTL_LOST_MAX_SECS*rate);
+    if (clamped) {
+        lost = RTL_LOST_MAX_SECS*rate;
+    }
+    fprintf(stderr, "rtl_tcp reconnected after %llu msecs, estimate %llu samples (%llu msecs) lost%s\n",
+            (now - downTime)/1000, lost, lost*1000/rate, clamped ? ", clamped" : "");
+    client->connectTime = now;
+    client->samplesReceived = 0;
+    return lost;
+}
+
+RtlTcpClient *rtlTcpCreate(const char *hostPort, const RtlTcpSettings *settings)
+{
+    RtlTcpClient *client = (RtlTcpClient *)calloc(1, sizeof(RtlTcpClient));
+    const char *colon = strrchr(hostPort, ':');
+
+    if (!client || !colon || colon == hostPort || colon[1] == '\0') {
+        fprintf(stderr, "rtl_tcp address must be host:port, not %s\n", hostPort);
+        free(client);
+        return NULL;
+    }
+    client->host = strndup(hostPort, colon - hostPort);
+    client->port = strdup(colon + 1);
+    client->settings = *settings;
+    client->fd = connectToServer(client);
+    if (client->fd < 0) {
+        rtlTcpDestroy(client);
+        return NULL;
+    }
+    client->connectTime = monotonicUsecs();
+    return client;
+}
+
+void rtlTcpDestroy(RtlTcpClient *client)
+{
+    if (!client) {
+        return;
+    }
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    free(client->host);
+    free(client->port);
+    free(client);
+}
+
+int rtlTcpFd(RtlTcpClient *client)
+{
+    return client->fd;
+}
+
+int rtlTcpRead(RtlTcpClient *client, unsigned char *buf, int len, unsigned long long *samplesLost)
+{
+    int offset = 0;
+    ssize_t n;
+
+    *samplesLost = 0;
+    if (len < 2) {
+        return 0;
+    }
+    for (;;) {
+        offset = 0;
+        if (client->haveCarry) {
+            buf[0] = client->carry;
+            offset = 1;
+        }
+        // One big read of whatever is waiting. Don't wait for more - that's latency.
+        n = recv(client->fd, buf + offset, len - offset, 0);
+        if (n > 0) {
+            // hand back whole samples only
+            n += offset;
+            client->haveCarry = (n & 1);
+            if (client->haveCarry) {
+                client->carry = buf[n - 1];
+                n--;
+            }
+            if (n > 0) {
+                client->samplesReceived += n/2;
+                break;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            fprintf(stderr, "rtl_tcp server closed the connection, reconnecting\n");
+        } else {
+            fprintf(stderr, "rtl_tcp read failed, %s, reconnecting\n",
+                    (errno == EAGAIN || errno == EWOULDBLOCK) ? "no data" : strerror(errno));
+        }
+        *samplesLost += reconnect(client);
+    }
+    return (int)n;
+}
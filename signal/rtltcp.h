@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2017, CSWales <cwales@medeagames.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RTLTCP_H
+#define RTLTCP_H
+
+#include <limits.h>
+
+/* rtl_tcp client. Connects to an rtl_tcp server, tunes the dongle, and hands back
+   raw samples. If the connection drops, it keeps trying to reconnect, and reports
+   how many samples went by in the meantime so the caller can keep its clock right. */
+
+typedef struct {
+    unsigned int sampleRate;    // Hz
+    unsigned int frequency;     // Hz, 0 to leave the server's setting alone
+    int gain;                   // tenths of a dB, or RTL_GAIN_AUTO
+} RtlTcpSettings;
+
+#define RTL_GAIN_AUTO INT_MIN   // 0 is a real gain setting, so automatic gain needs its own value
+
+typedef struct RtlTcpClient RtlTcpClient;
+
+// hostPort is host:port. Fails if the first connection fails.
+RtlTcpClient *rtlTcpCreate(const char *hostPort, const RtlTcpSettings *settings);
+void rtlTcpDestroy(RtlTcpClient *client);
+
+// Current socket. Changes on reconnect.
+int rtlTcpFd(RtlTcpClient *client);
+
+// Read up to len bytes of samples, always a whole number of samples. Blocks, and
+// reconnects as needed, forever; *samplesLost is set to the number of samples that
+// went by while we were disconnected (usually 0, and at most RTL_LOST_MAX_SECS worth).
+// Only returns 0 if len is too small.
+int rtlTcpRead(RtlTcpClient *client, unsigned char *buf, int len, unsigned long long *samplesLost);
+
+#endif // RTLTCP_H